@@ -3,34 +3,146 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // defines 
 
 #define FEMTO_VERSION "0.1.0"
 #define TAB_STOP 2
 #define FEMTO_QUIT_TIMES 3
+#define FEMTO_UNDO_BUDGET (8 * 1024 * 1024)
+#define FEMTO_PROBE_ROWS 4096
+#define FEMTO_SEARCH_HISTORY 32
+#define FEMTO_SESSION_SAVE_MS (30 * 1000)
 
 #define CRTL_KEY(k) ((k) & 0x1f)
 
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+// hl_state values at the end of a row. Inside a string the state is the
+// quote character itself.
+#define HL_STATE_NORMAL 0
+#define HL_STATE_COMMENT 1
+
 // data structures
 
 struct erow {
   int size;
   int rsize;
+  bool ascii; // no byte >= 0x80, so every byte is one column
+  unsigned char hl_state; // lexer state at the end of the row
+  unsigned char chars_cls; // row_pool size classes of the three buffers
+  unsigned char render_cls;
+  unsigned char hl_cls;
   char *chars;
   char *render;
+  unsigned char *hl;
+  struct cold_block *cold; // set when the text lives in a compressed block
+  uint32_t cold_off;
+};
+
+enum editor_highlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER
+};
+
+// The edits the row primitives report to the undo journal and swap file
+enum edit_type {
+  EDIT_INSERT_TEXT,
+  EDIT_DEL_TEXT,
+  EDIT_INSERT_ROW,
+  EDIT_DEL_ROW,
+  // a range of rows at once: row is the first and len how many
+  EDIT_INSERT_ROWS,
+  EDIT_DEL_ROWS,
+  // reorder rows: text is an array of ints, the new order of the rows from
+  // row on by their offset from it, and len its size in bytes
+  EDIT_PERMUTE
+};
+
+// A run of rows held outside of any buffer, for the yank register and for
+// undoing bulk edits. The rows are all cold: rows that were cold already
+// share their blocks (the blocks' live counts cover both), warm ones get
+// their text copied once into blocks of the clip's own. Putting a clip back
+// doesn't copy any text.
+struct clip {
+  struct erow *rows;
+  int count;
+  int refs;
+  uint32_t id; // names its rows in the swap file
+};
+
+struct undo_entry {
+  struct undo_entry *prev;
+  struct undo_entry *next;
+  long group;
+  unsigned char type;
+  bool typing;
+  int row;
+  int at;
+  int len;
+  int cap;
+  int cx, cy; // cursor before the command, cx relative to the text
+  int cx_after, cy_after;
+  char *text;
+  struct clip *clip; // the rows, for bulk edits
+};
+
+struct undo_journal {
+  struct undo_entry *head;
+  struct undo_entry *tail;
+  struct undo_entry *cur;
+  size_t bytes;
+  size_t budget;
+  long group;
+  long saved_group;
+  long dropped_group;
+  bool typing;
+  int suspended;
+  int cx, cy;
+};
+
+struct editor_syntax {
+  char *filetype;
+  char **filematch;
+  char **keywords;
+  char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  int flags;
 };
 
 enum editor_key {
@@ -43,7 +155,8 @@ enum editor_key {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  UTF8_KEY // a character of more than one byte, in ed_cfg.key_text
 };
 
 // append buffer
@@ -68,25 +181,193 @@ void abuf_free(struct abuf *ab)
   free(ab->b);
 }
 
+#define POOL_CHUNK_SIZE (256 * 1024)
+#define POOL_LARGE 0xfe // block came from malloc, see struct pool_large
+#define POOL_NONE 0xff  // no block at all
+
+static const uint32_t pool_class_size[] = {
+  16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+  3072, 4096
+};
+
+#define POOL_CLASSES (sizeof(pool_class_size) / sizeof(pool_class_size[0]))
+
+struct pool_chunk {
+  struct pool_chunk *next;
+  size_t reserved; // keeps the blocks after the header 16 byte aligned
+};
+
+struct pool_large {
+  struct pool_large *prev;
+  struct pool_large *next;
+  size_t size;
+  size_t reserved;
+};
+
+struct row_pool {
+  struct pool_chunk *chunks;
+  char *bump;
+  size_t bump_left;
+  void *free_list[POOL_CLASSES];
+  struct pool_large *large;
+  size_t bytes;  // handed out and not yet freed, rounded up to class size
+  size_t *total; // the same, across every buffer's pool
+};
+
+// A read-only mapping of a file that rows can borrow their text from. Every
+// buffer that opens the same file shares one.
+struct file_map {
+  struct file_map *next;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int fd; // kept open to see if the file changes under us
+  char *name;
+  char *base;
+  size_t len;
+  int refs; // blocks pointing into it
+  bool copied; // the file changed, so base is a copy of what was left of it
+};
+
+struct cold_block {
+  struct cold_block *prev; // all blocks
+  struct cold_block *next;
+  struct cold_block *lru_prev; // blocks in the decompressed cache
+  struct cold_block *lru_next;
+  char *data;
+  char *raw; // decompressed data while cached
+  uint32_t clen;
+  uint32_t rawlen;
+  int live; // cold rows still in this block
+  bool compressed;
+  struct file_map *map; // data points into this mapping, and isn't ours
+};
+
+struct cold_store {
+  bool enabled;
+  size_t budget;
+  size_t warm_limit;  // freeze rows once the pool holds more than this
+  size_t cache_cap;   // bytes of decompressed blocks to keep around
+  size_t cache_bytes;
+  size_t compressed_bytes;
+  size_t next_sweep;
+  struct cold_block *blocks;
+  struct cold_block *lru_head;
+  struct cold_block *lru_tail;
+};
+
+struct cold_reader {
+  struct cold_block *block;
+  char *buf;
+  size_t cap;
+};
+
+struct line_filter {
+  char *pattern; // NULL when there's no filter at all
+  bool active;   // showing only the filtered rows
+  int *rows;
+  int count;
+  int cap;
+};
+
+struct line_index {
+  long long *offsets;
+  int valid; // offsets of rows before this are up to date
+  int cap;
+};
+
+struct swap_file {
+  int fd;
+  char *path;
+  struct abuf pending; // records not written yet
+  bool unsynced;       // written but not fsynced
+  long long last_sync;
+  int suspended;
+  bool recover; // opening it waits until the buffer is on screen
+  uint32_t *clips; // ids of the clips whose rows are in the journal
+  int nclips;
+  int clips_cap;
+};
+
 // Defines
 #define CTRL_KEY(k) ((k) & 0x1f)
 
 // Data
-struct editor_config {
+// The cursor is the other end of the selection
+struct selection {
+  bool active;
+  bool lines; // whole lines, rather than from one character to another
+  int row;
+  int col;
+};
+
+// What was last cut or copied: the rows of a clip, starting at byte head of
+// the first and ending at byte tail of the last
+struct yank_register {
+  struct clip *clip;
+  bool lines;
+  int head;
+  int tail;
+};
+
+// Everything that belongs to one open file
+struct buffer {
+  struct buffer *prev;
+  struct buffer *next;
   int cx, cy;
   int rx;
   int row_offset;
   int col_offset;
-  int screenrows;
-  int screencols;
   int margin_width;
   int display_cols;
   int numrows;
+  int rows_cap;
   struct erow *rows;
+  int cold_scan; // rows before this have been considered by the cold sweep
+  struct line_filter filter;
+  struct line_index lines;
   bool dirty;
   char *filename;
-  char status_msg[80];
+  struct editor_syntax *syntax;
+  int hl_frontier;
+  struct undo_journal undo;
+  struct swap_file swap;
+  struct row_pool pool;
+  struct selection sel;
+  int format;               // enum file_format of the file as it was opened
+  struct stream_load *load; // still coming in from a compressed file
+};
+
+// Past searches, oldest first
+struct search_history {
+  char *items[FEMTO_SEARCH_HISTORY];
+  int count;
+};
+
+// The buffers share the memory budget (each has its own row pool, but they
+// count their bytes together), the cold store and its cache of decompressed
+// blocks, and the file mappings.
+struct editor_config {
+  int screenrows;
+  int screencols;
+  struct buffer *buf; // the one on screen
+  struct buffer *buffers;
+  int nbuffers;
+  size_t row_bytes; // handed out by all the row pools
+  struct cold_store cold;
+  struct file_map *maps;
+  struct yank_register yank;
+  uint32_t clip_ids; // the last id given to a clip
+  struct search_history searches;
+  char *session; // image to restore from and save to, with -s
+  bool session_behind; // edited since the image was last written
+  long long session_written;
+  size_t undo_budget;
+  bool swap_enabled;
+  char status_msg[256];
   time_t status_msg_time;
+  char key_text[4]; // the bytes of the last UTF8_KEY
+  int key_len;
   struct termios orig_termios;
 };
 
@@ -95,9 +376,31 @@ struct editor_config ed_cfg;
 // prototypes 
 
 void editor_set_margin_width(void);
+void editor_update_syntax(struct erow *row);
+void editor_record_edit(int type, int row, int at, const char *text, int len);
+void editor_record_bulk(int type, int row, int count, struct clip *clip, int from);
+bool editor_undo_recording(void);
 void editor_set_status_message(const char *fmt, ...);
 void editor_refresh_screen(void);
+bool editor_loading(void);
+bool editor_stream_poll(struct buffer *b);
+bool write_all(int fd, const char *buf, size_t len);
+void editor_init_screen(void);
+bool editor_session_save(const char *path, bool full);
+void editor_stream_stop(struct buffer *b);
 char *editor_prompt(char *prompt, void (*callback)(char *, int));
+bool editor_confirm(const char *question);
+void editor_idle(void);
+void editor_cold_idle(void);
+void editor_filter_note_edit(int type, int row, int at, const char *text, int len);
+bool editor_permutation_valid(const int *perm, int n);
+void editor_filter_note_bulk(int type, int row, int count);
+void editor_line_index_note_edit(int row);
+long long editor_file_bytes(void);
+void editor_cursor_fix_column(int prev_rx, bool prev_ascii);
+long long parse_size(const char *s);
+int editor_view_to_row(int v);
+int editor_buffer_view_to_row(struct buffer *b, int v);
 
 // terminal
 void die(const char *s)
@@ -139,9 +442,24 @@ int editor_read_key(void)
 {
   int nread;
   char c;
-  while ((nread = read(STDERR_FILENO, &c, 1)) != 1) {
+  while (1) {
+    // while a file is loading, wait for keys a little at a time and take
+    // in its lines in between
+    if (editor_loading()) {
+      struct pollfd pfd = { STDERR_FILENO, POLLIN, 0 };
+      if (poll(&pfd, 1, 20) == 0) {
+        editor_idle();
+        editor_cold_idle();
+        continue;
+      }
+    }
+
+    if ((nread = read(STDERR_FILENO, &c, 1)) == 1)
+      break;
     if (nread == -1 && errno != EAGAIN)
       die("read");
+    editor_idle();
+    editor_cold_idle();
   }
 
   if (c == '\x1b') {
@@ -188,354 +506,5571 @@ int editor_read_key(void)
 
     return '\x1b';
   }
+
+  // the rest of a multibyte character is already waiting, and it goes in
+  // as one edit rather than a byte at a time
+  unsigned char lead = c;
+  if (lead >= 0xc0) {
+    int n = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2;
+    ed_cfg.key_text[0] = c;
+    ed_cfg.key_len = 1;
+    while (ed_cfg.key_len < n &&
+        read(STDERR_FILENO, &ed_cfg.key_text[ed_cfg.key_len], 1) == 1)
+      ed_cfg.key_len++;
+    return UTF8_KEY;
+  }
   
-  return c;
+  return (unsigned char)c;
 }
 
-// row operations
+// row storage
 
-int editor_row_cx_to_rx(struct erow *row, int cx)
+// Row text, render buffers and highlight arrays all come from the buffer's
+// row_pool rather than straight from malloc. Requests are rounded up to one
+// of a small set of size classes and carved out of big chunks; freed blocks
+// go on a per-class free list for reuse. A row growing one typed character
+// at a time stays in the same block until it outgrows its class. The few
+// lines too long for any class get their own malloc, kept on a list, so
+// throwing the whole buffer away is just freeing the chunks.
+
+int pool_class_for(size_t size)
 {
-  int rx = 0;
-  for (int j = 0; j < cx; j++) {
-    if (row->chars[j] == '\t')
-      rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-    rx++;
+  for (unsigned int cls = 0; cls < POOL_CLASSES; cls++) {
+    if (size <= pool_class_size[cls])
+      return cls;
   }
 
-  return rx;
+  return POOL_LARGE;
 }
 
-int editor_row_rx_to_cx(struct erow *row, int rx)
+size_t pool_block_size(void *ptr, unsigned char cls)
 {
-  int curr_rx = 0;
-  int cx = 0;
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t')
-      curr_rx += (TAB_STOP - 1) - (curr_rx % TAB_STOP);
-    ++curr_rx;
+  if (cls == POOL_NONE)
+    return 0;
+  if (cls == POOL_LARGE)
+    return ((struct pool_large *)ptr - 1)->size;
 
-    if (curr_rx > rx)
-      return cx;
-  }
+  return pool_class_size[cls];
+}
 
-  return cx;
+void pool_count(struct row_pool *pool, size_t size, bool add)
+{
+  pool->bytes = add ? pool->bytes + size : pool->bytes - size;
+  if (pool->total)
+    *pool->total = add ? *pool->total + size : *pool->total - size;
 }
 
-void editor_update_row(struct erow *row)
+void *pool_alloc(struct row_pool *pool, size_t size, unsigned char *cls)
 {
-  int tabs = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t')
-      ++tabs;
+  int c = pool_class_for(size);
+
+  if (c == POOL_LARGE) {
+    struct pool_large *big = malloc(sizeof(struct pool_large) + size);
+    if (big == NULL)
+      die("malloc");
+    big->size = size;
+    big->prev = NULL;
+    big->next = pool->large;
+    if (pool->large)
+      pool->large->prev = big;
+    pool->large = big;
+    pool_count(pool, size, true);
+    *cls = POOL_LARGE;
+    return big + 1;
   }
 
-  free(row->render);
-  row->render = malloc(row->size + tabs*(TAB_STOP - 1) + 1);
+  *cls = c;
+  pool_count(pool, pool_class_size[c], true);
+  if (pool->free_list[c]) {
+    void *ptr = pool->free_list[c];
+    memcpy(&pool->free_list[c], ptr, sizeof(void *));
+    return ptr;
+  }
 
-  int idx = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % TAB_STOP != 0)
-        row->render[idx++] = ' ';
-    }
-    else {
-      row->render[idx++] = row->chars[j];
-    }
+  if (pool->bump_left < pool_class_size[c]) {
+    struct pool_chunk *chunk = malloc(POOL_CHUNK_SIZE);
+    if (chunk == NULL)
+      die("malloc");
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->bump = (char *)(chunk + 1);
+    pool->bump_left = POOL_CHUNK_SIZE - sizeof(struct pool_chunk);
   }
 
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  void *ptr = pool->bump;
+  pool->bump += pool_class_size[c];
+  pool->bump_left -= pool_class_size[c];
+
+  return ptr;
 }
 
-void editor_insert_row(int at, char *s, size_t len)
+void pool_free(struct row_pool *pool, void *ptr, unsigned char cls)
 {
-  if (at < 0 || at > ed_cfg.numrows)
+  if (ptr == NULL || cls == POOL_NONE)
     return;
 
-  ed_cfg.rows = realloc(ed_cfg.rows, sizeof(struct erow) * (ed_cfg.numrows + 1));
-  memmove(&ed_cfg.rows[at + 1], &ed_cfg.rows[at], 
-    sizeof(struct erow) * (ed_cfg.numrows - at));
-
-  ed_cfg.rows[at].size = len;
-  ed_cfg.rows[at].chars = malloc(len + 1);
-  memcpy(ed_cfg.rows[at].chars, s, len);
-  ed_cfg.rows[at].chars[len] = '\0';
-
-  ed_cfg.rows[at].rsize = 0;
-  ed_cfg.rows[at].render = NULL;
-  editor_update_row(&ed_cfg.rows[at]);
-
-  ed_cfg.numrows++;
-  ed_cfg.dirty = true;
-}
+  if (cls == POOL_LARGE) {
+    struct pool_large *big = (struct pool_large *)ptr - 1;
+    if (big->prev)
+      big->prev->next = big->next;
+    else
+      pool->large = big->next;
+    if (big->next)
+      big->next->prev = big->prev;
+    pool_count(pool, big->size, false);
+    free(big);
+    return;
+  }
 
-void editor_free_row(struct erow *row)
-{
-  free(row->render);
-  free(row->chars);
+  memcpy(ptr, &pool->free_list[cls], sizeof(void *));
+  pool->free_list[cls] = ptr;
+  pool_count(pool, pool_class_size[cls], false);
 }
 
-void editor_del_row(int at)
+// Grow or shrink a block, keeping its contents. Stays put if the new size
+// still fits the block we have.
+void *pool_realloc(struct row_pool *pool, void *ptr, unsigned char *cls, 
+  size_t size)
 {
-  if (at < 0 || at >= ed_cfg.numrows)
-    return;
+  size_t old = pool_block_size(ptr, *cls);
+  if (ptr && *cls != POOL_LARGE && size <= old)
+    return ptr;
+
+  unsigned char new_cls;
+  void *new = pool_alloc(pool, size, &new_cls);
+  if (ptr) {
+    memcpy(new, ptr, old < size ? old : size);
+    pool_free(pool, ptr, *cls);
+  }
+  *cls = new_cls;
 
-  editor_free_row(&ed_cfg.rows[at]);
-  memmove(&ed_cfg.rows[at], &ed_cfg.rows[at + 1], 
-    sizeof(struct erow) * (ed_cfg.numrows - at - 1));
-  --ed_cfg.numrows;
-  ed_cfg.dirty = true;
+  return new;
 }
 
-void editor_row_insert_char(struct erow *row, int at, int c) 
+// Like pool_realloc but for buffers that get rewritten from scratch, so
+// nothing is copied when we have to move
+void *pool_reserve(struct row_pool *pool, void *ptr, unsigned char *cls,
+  size_t size)
 {
-  if (at < 0 || at > row->size)
-    at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
+  if (ptr && *cls != POOL_LARGE && size <= pool_block_size(ptr, *cls))
+    return ptr;
 
-  editor_update_row(row);
-  ed_cfg.dirty = true;
+  pool_free(pool, ptr, *cls);
+  return pool_alloc(pool, size, cls);
 }
 
-void editor_row_append_str(struct erow *row, char *s, size_t len)
+void pool_destroy(struct row_pool *pool)
 {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editor_update_row(row);
-  ed_cfg.dirty = true;
-}
+  struct pool_chunk *chunk = pool->chunks;
+  while (chunk) {
+    struct pool_chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
 
-void editor_row_del_char(struct erow *row, int at)
-{
-  if (at < 0 || at >= row->size)
-    return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  --row->size;
-  editor_update_row(row);
-  ed_cfg.dirty = true;
+  struct pool_large *big = pool->large;
+  while (big) {
+    struct pool_large *next = big->next;
+    free(big);
+    big = next;
+  }
+
+  size_t *total = pool->total;
+  pool_count(pool, pool->bytes, false);
+  memset(pool, 0, sizeof(*pool));
+  pool->total = total;
 }
 
-// editor operations
+// unicode
 
-void editor_insert_char(int c)
+// True if none of the len bytes at s has the high bit set. Almost every line
+// of a config file or log passes this, and for those rows we keep using the
+// plain byte-per-column loops, so check 64 bytes per iteration with SSE2
+// where we have it and a word at a time otherwise.
+bool utf8_is_ascii(const char *s, size_t len)
 {
-  if (ed_cfg.cy == ed_cfg.numrows) {
-    editor_insert_row(ed_cfg.numrows, "", 0);
+  size_t j = 0;
+
+#ifdef __SSE2__
+  for (; j + 64 <= len; j += 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + j));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + j + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(s + j + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *)(s + j + 48));
+    if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))))
+      return false;
+  }
+  for (; j + 16 <= len; j += 16) {
+    if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + j))))
+      return false;
+  }
+#endif
+  for (; j + 8 <= len; j += 8) {
+    uint64_t w;
+    memcpy(&w, s + j, 8);
+    if (w & 0x8080808080808080ULL)
+      return false;
+  }
+  for (; j < len; j++) {
+    if ((unsigned char)s[j] & 0x80)
+      return false;
   }
 
-  int at = ed_cfg.cx - ed_cfg.margin_width;
-  editor_row_insert_char(&ed_cfg.rows[ed_cfg.cy], at, c);
-  ++ed_cfg.cx;
+  return true;
 }
 
-void editor_insert_newline(void)
+// Decode the code point starting at s (at most len bytes). Returns how many
+// bytes it used. Malformed or truncated sequences decode as U+FFFD and
+// consume one byte so we always make progress.
+int utf8_decode(const char *s, int len, uint32_t *cp)
 {
-  if (ed_cfg.numrows == 0) {
-    editor_insert_row(0, "", 0);
-    ed_cfg.cx = ed_cfg.margin_width + 1;
-    return;
+  const unsigned char *u = (const unsigned char *)s;
+  uint32_t c = u[0];
+  int n;
+  uint32_t min;
+
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  }
+  else if ((c & 0xe0) == 0xc0) {
+    n = 2;
+    c &= 0x1f;
+    min = 0x80;
   }
-  else if (ed_cfg.cx <= ed_cfg.margin_width) {
-    editor_insert_row(ed_cfg.cy, "", 0);
+  else if ((c & 0xf0) == 0xe0) {
+    n = 3;
+    c &= 0x0f;
+    min = 0x800;
+  }
+  else if ((c & 0xf8) == 0xf0) {
+    n = 4;
+    c &= 0x07;
+    min = 0x10000;
   }
   else {
-    int pos_in_line = ed_cfg.cx - ed_cfg.margin_width - 1;
-    struct erow *row = &ed_cfg.rows[ed_cfg.cy];
-    editor_insert_row(ed_cfg.cy + 1, &row->chars[pos_in_line],
-      row->size -pos_in_line);
-    row = &ed_cfg.rows[ed_cfg.cy];
-    row->size = pos_in_line;
-    row->chars[row->size] = '\0';
-    editor_update_row(row);
+    *cp = 0xfffd;
+    return 1;
   }
 
-  ++ed_cfg.cy;
-  ed_cfg.cx = ed_cfg.margin_width;
-}
-
-void editor_del_char(void)
-{
-  if (ed_cfg.cy == ed_cfg.numrows)
-    return;
-  if (ed_cfg.cx == 0 && ed_cfg.cy == 0)
-    return;
-
-  struct erow *row = &ed_cfg.rows[ed_cfg.cy];
-  if (ed_cfg.cx > ed_cfg.margin_width) {
-    int at = ed_cfg.cx - ed_cfg.margin_width - 1;
-    editor_row_del_char(row, at);
-    --ed_cfg.cx;
+  if (n > len) {
+    *cp = 0xfffd;
+    return 1;
   }
-  else {
-    ed_cfg.cx = ed_cfg.rows[ed_cfg.cy - 1].size + ed_cfg.margin_width;
-    editor_row_append_str(&ed_cfg.rows[ed_cfg.cy - 1], row->chars, row->size);
-    editor_del_row(ed_cfg.cy);
-    --ed_cfg.cy;
+  for (int j = 1; j < n; j++) {
+    if ((u[j] & 0xc0) != 0x80) {
+      *cp = 0xfffd;
+      return 1;
+    }
+    c = (c << 6) | (u[j] & 0x3f);
   }
+  if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+    *cp = 0xfffd;
+    return 1;
+  }
+
+  *cp = c;
+  return n;
 }
 
-// file i/o
+struct cp_range {
+  uint32_t first;
+  uint32_t last;
+};
+
+// Combining marks and other code points that take no space of their own
+static const struct cp_range zero_width[] = {
+  { 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd },
+  { 0x05bf, 0x05bf }, { 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 },
+  { 0x05c7, 0x05c7 }, { 0x0610, 0x061a }, { 0x064b, 0x065f },
+  { 0x0670, 0x0670 }, { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+  { 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0900, 0x0902 },
+  { 0x093a, 0x093a }, { 0x093c, 0x093c }, { 0x0941, 0x0948 },
+  { 0x094d, 0x094d }, { 0x0951, 0x0957 }, { 0x0e31, 0x0e31 },
+  { 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e }, { 0x1ab0, 0x1aff },
+  { 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x202a, 0x202e },
+  { 0x2060, 0x2064 }, { 0x20d0, 0x20ff }, { 0x302a, 0x302d },
+  { 0x3099, 0x309a }, { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f },
+  { 0xfeff, 0xfeff }, { 0x1f3fb, 0x1f3ff }, { 0xe0001, 0xe007f },
+  { 0xe0100, 0xe01ef }
+};
 
-char *editor_rows_to_str(int *buflen)
+// East Asian Wide and Fullwidth blocks, which terminals draw two cells wide
+static const struct cp_range double_width[] = {
+  { 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a },
+  { 0x23e9, 0x23ec }, { 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 },
+  { 0x25fd, 0x25fe }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 },
+  { 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+  { 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 },
+  { 0x26ce, 0x26ce }, { 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea },
+  { 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 }, { 0x26fa, 0x26fa },
+  { 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+  { 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e },
+  { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+  { 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf }, { 0x2b1b, 0x2b1c },
+  { 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }, { 0x2e80, 0x3029 },
+  { 0x302e, 0x303e }, { 0x3041, 0x3098 }, { 0x309b, 0x33ff },
+  { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+  { 0xa960, 0xa97f }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff },
+  { 0xfe10, 0xfe19 }, { 0xfe30, 0xfe6f }, { 0xff00, 0xff60 },
+  { 0xffe0, 0xffe6 }, { 0x16fe0, 0x16fe4 }, { 0x17000, 0x18cff },
+  { 0x1b000, 0x1b2ff }, { 0x1f004, 0x1f004 }, { 0x1f0cf, 0x1f0cf },
+  { 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a }, { 0x1f200, 0x1f251 },
+  { 0x1f300, 0x1f320 }, { 0x1f32d, 0x1f335 }, { 0x1f337, 0x1f37c },
+  { 0x1f37e, 0x1f393 }, { 0x1f3a0, 0x1f3ca }, { 0x1f3cf, 0x1f3d3 },
+  { 0x1f3e0, 0x1f3f0 }, { 0x1f3f4, 0x1f3f4 }, { 0x1f3f8, 0x1f3fa },
+  { 0x1f400, 0x1f43e }, { 0x1f440, 0x1f440 }, { 0x1f442, 0x1f4fc },
+  { 0x1f4ff, 0x1f53d }, { 0x1f54b, 0x1f54e }, { 0x1f550, 0x1f567 },
+  { 0x1f57a, 0x1f57a }, { 0x1f595, 0x1f596 }, { 0x1f5a4, 0x1f5a4 },
+  { 0x1f5fb, 0x1f64f }, { 0x1f680, 0x1f6c5 }, { 0x1f6cc, 0x1f6cc },
+  { 0x1f6d0, 0x1f6d2 }, { 0x1f6d5, 0x1f6d7 }, { 0x1f6eb, 0x1f6ec },
+  { 0x1f6f4, 0x1f6fc }, { 0x1f7e0, 0x1f7eb }, { 0x1f90c, 0x1f93a },
+  { 0x1f93c, 0x1f945 }, { 0x1f947, 0x1f9ff }, { 0x1fa70, 0x1faff },
+  { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd }
+};
+
+bool cp_in_ranges(uint32_t cp, const struct cp_range *ranges, int count)
 {
-  int totlen = 0;
-  
-  for (int j = 0; j < ed_cfg.numrows; j++)
-    totlen += ed_cfg.rows[j].size + 1;
-  *buflen = totlen;
-
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (int j = 0; j < ed_cfg.numrows; j++) {
-    memcpy(p, ed_cfg.rows[j].chars, ed_cfg.rows[j].size);
-    p += ed_cfg.rows[j].size;
-    *p = '\n';
-    ++p;
+  int lo = 0;
+  int hi = count - 1;
+
+  if (cp < ranges[0].first || cp > ranges[hi].last)
+    return false;
+
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < ranges[mid].first)
+      hi = mid - 1;
+    else if (cp > ranges[mid].last)
+      lo = mid + 1;
+    else
+      return true;
   }
 
-  return buf;
+  return false;
 }
 
-void editor_open(char *filename)
+// How many terminal cells a code point occupies once it's in the render
+// buffer. Control characters are drawn as a single '?' (see
+// editor_update_row) so they count as one column.
+int cp_width(uint32_t cp)
 {
-  free(ed_cfg.filename);
-  ed_cfg.filename = strdup(filename);
+  if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0))
+    return 1;
+  if (cp < 0x300)
+    return 1;
+  if (cp_in_ranges(cp, zero_width, sizeof(zero_width) / sizeof(zero_width[0])))
+    return 0;
+  if (cp_in_ranges(cp, double_width, sizeof(double_width) / sizeof(double_width[0])))
+    return 2;
+
+  return 1;
+}
+
+// syntax highlighting
+
+// Highlighting is stored per byte of row->render. Each row also remembers
+// the lexer state at its end (hl_state), which is all the next row needs to
+// start lexing. Rows [0, ed_cfg.buf->hl_frontier) have valid highlighting; rows
+// past that are lexed lazily the first time they're drawn. After an edit we
+// re-lex from the changed row until a row's end state comes out the same as
+// before, or until we run off the bottom of the screen, in which case the
+// frontier is pulled back and the rest is picked up lazily.
+
+char *c_hl_extensions[] = { ".c", ".h", ".cpp", ".hpp", ".cc", ".cxx", 
+  ".java", ".js", ".ts", ".go", ".rs", ".cs", NULL };
+char *c_hl_keywords[] = {
+  "switch", "if", "while", "for", "break", "continue", "return", "else",
+  "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+  "goto", "do", "sizeof", "const", "extern", "volatile", "inline", "fn",
+  "let", "func", "package", "import", "public", "private", "protected",
+  "new", "delete", "namespace", "template", "this", "true", "false", "NULL",
+  "nullptr", "#include", "#define", "#ifdef", "#ifndef", "#endif", "#if",
+  "#else", "#elif", "#pragma",
+
+  "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+  "void|", "bool|", "short|", "size_t|", "ssize_t|", "uint8_t|", "uint16_t|",
+  "uint32_t|", "uint64_t|", "int8_t|", "int16_t|", "int32_t|", "int64_t|",
+  "auto|", NULL
+};
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
+char *sh_hl_extensions[] = { ".sh", ".bash", ".py", ".pl", ".rb", ".conf",
+  ".cfg", ".ini", ".yml", ".yaml", ".toml", "Makefile", NULL };
+char *sh_hl_keywords[] = {
+  "if", "then", "else", "elif", "fi", "for", "while", "do", "done", "case",
+  "esac", "function", "return", "in", "def", "class", "import", "from",
+  "pass", "with", "as", "try", "except", "finally", "raise", "lambda",
+  "yield", "not", "and", "or", "is", "export", "local",
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t line_len;
-  while ((line_len = getline(&line, &linecap, fp)) != -1) {
-    while (line_len > 0 && (line[line_len - 1] == '\n' ||
-                           line[line_len - 1] == '\r'))
-      line_len--;
+  "True|", "False|", "None|", "true|", "false|", "yes|", "no|", NULL
+};
 
-    editor_insert_row(ed_cfg.numrows, line, line_len);
+struct editor_syntax hl_db[] = {
+  {
+    "c",
+    c_hl_extensions,
+    c_hl_keywords,
+    "//", "/*", "*/",
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+  },
+  {
+    "script",
+    sh_hl_extensions,
+    sh_hl_keywords,
+    "#", NULL, NULL,
+    HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
   }
+};
 
-  free(line);
-  fclose(fp);
-  ed_cfg.dirty = false;
+#define HL_DB_ENTRIES (sizeof(hl_db) / sizeof(hl_db[0]))
 
-  editor_set_margin_width();
+bool is_separator(int c)
+{
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}:&|!?^", c) != NULL;
 }
 
-void editor_save(void)
+// Lex one row, given the state the previous row ended in, filling row->hl
+// and setting row->hl_state to the state at the end of this row
+void editor_lex_row(struct erow *row, unsigned char state)
 {
-  if (!ed_cfg.filename) {
-		ed_cfg.filename = editor_prompt("Save as: %s", NULL);
-		if (ed_cfg.filename == NULL) {
-			editor_set_status_message("Nevermind.");
-			return;
-		}
-	}
+  struct editor_syntax *syntax = ed_cfg.buf->syntax;
+  unsigned char *hl = pool_reserve(&ed_cfg.buf->pool, row->hl, &row->hl_cls, 
+    row->rsize ? row->rsize : 1);
+  row->hl = hl;
+  memset(hl, HL_NORMAL, row->rsize);
+
+  char **keywords = syntax->keywords;
+  char *scs = syntax->singleline_comment_start;
+  char *mcs = syntax->multiline_comment_start;
+  char *mce = syntax->multiline_comment_end;
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  bool prev_sep = true;
+  int in_string = state != HL_STATE_COMMENT ? state : 0;
+  bool in_comment = state == HL_STATE_COMMENT;
+
+  int i = 0;
+  while (i < row->rsize) {
+    char c = row->render[i];
+    unsigned char prev_hl = i > 0 ? hl[i - 1] : HL_NORMAL;
+
+    if (scs_len && !in_string && !in_comment) {
+      if (!strncmp(&row->render[i], scs, scs_len)) {
+        memset(&hl[i], HL_COMMENT, row->rsize - i);
+        break;
+      }
+    }
 
-  int len;
-  char *buf = editor_rows_to_str(&len);
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        hl[i] = HL_MLCOMMENT;
+        if (!strncmp(&row->render[i], mce, mce_len)) {
+          memset(&hl[i], HL_MLCOMMENT, mce_len);
+          i += mce_len;
+          in_comment = false;
+          prev_sep = true;
+        }
+        else {
+          ++i;
+        }
+        continue;
+      }
+      else if (!strncmp(&row->render[i], mcs, mcs_len)) {
+        memset(&hl[i], HL_MLCOMMENT, mcs_len);
+        i += mcs_len;
+        in_comment = true;
+        continue;
+      }
+    }
 
-  int fd = open(ed_cfg.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {        
-        close(fd);
-        free(buf);
-        ed_cfg.dirty = false;
-        editor_set_status_message("%d bytes written to disk", len);
-        return;
+    if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        hl[i] = HL_STRING;
+        if (c == '\\' && i + 1 < row->rsize) {
+          hl[i + 1] = HL_STRING;
+          i += 2;
+          continue;
+        }
+        if (c == in_string)
+          in_string = 0;
+        ++i;
+        prev_sep = true;
+        continue;
+      }
+      else if (c == '"' || c == '\'' || c == '`') {
+        in_string = c;
+        hl[i] = HL_STRING;
+        ++i;
+        continue;
       }
     }
-    close(fd);
+
+    if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+          (c == '.' && prev_hl == HL_NUMBER)) {
+        hl[i] = HL_NUMBER;
+        ++i;
+        prev_sep = false;
+        continue;
+      }
+    }
+
+    if (prev_sep) {
+      int j;
+      for (j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        bool kw2 = keywords[j][klen - 1] == '|';
+        if (kw2)
+          klen--;
+
+        if (i + klen <= row->rsize &&
+            !strncmp(&row->render[i], keywords[j], klen) &&
+            is_separator((unsigned char)row->render[i + klen])) {
+          memset(&hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+          i += klen;
+          break;
+        }
+      }
+      if (keywords[j] != NULL) {
+        prev_sep = false;
+        continue;
+      }
+    }
+
+    prev_sep = is_separator((unsigned char)c);
+    ++i;
   }
 
-  free(buf);
-  editor_set_status_message("Buffer not saved! I/O error: %s", strerror(errno));
+  // only a backslash at the very end lets a string run onto the next line
+  if (in_string && !(row->rsize > 0 && row->render[row->rsize - 1] == '\\'))
+    in_string = 0;
+  row->hl_state = in_comment ? HL_STATE_COMMENT : in_string;
 }
 
-// find
+void editor_render_row(struct buffer *buf, struct erow *row);
+char *editor_row_text(struct erow *row);
 
-void editor_find_callback(char *query, int key)
+// Work out the end state of a cold row without thawing it, by lexing a
+// throwaway copy
+void editor_lex_row_state(struct erow *row, unsigned char state)
 {
-  static int last_match = -1;
-  static int direction = 1;
+  struct erow tmp = { 0 };
+  tmp.size = row->size;
+  tmp.chars = editor_row_text(row);
+  tmp.render_cls = tmp.hl_cls = POOL_NONE;
 
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+  editor_render_row(ed_cfg.buf, &tmp);
+  editor_lex_row(&tmp, state);
+  row->hl_state = tmp.hl_state;
+
+  pool_free(&ed_cfg.buf->pool, tmp.render, tmp.render_cls);
+  pool_free(&ed_cfg.buf->pool, tmp.hl, tmp.hl_cls);
+}
+
+void editor_lex_any_row(struct erow *row, unsigned char state)
+{
+  if (row->cold)
+    editor_lex_row_state(row, state);
+  else
+    editor_lex_row(row, state);
+}
+
+unsigned char editor_hl_start_state(int at)
+{
+  return at > 0 ? ed_cfg.buf->rows[at - 1].hl_state : HL_STATE_NORMAL;
+}
+
+// Lex rows up to and including `at` if they aren't already
+void editor_hl_ensure(int at)
+{
+  if (ed_cfg.buf->syntax == NULL)
     return;
+  if (at >= ed_cfg.buf->numrows)
+    at = ed_cfg.buf->numrows - 1;
+
+  while (ed_cfg.buf->hl_frontier <= at) {
+    int r = ed_cfg.buf->hl_frontier;
+    editor_lex_any_row(&ed_cfg.buf->rows[r], editor_hl_start_state(r));
+    ed_cfg.buf->hl_frontier++;
   }
-  else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  }
-  else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  }
-  else {
-    last_match = -1;
-    direction = 1;
-  }
+}
 
-  if (last_match == -1)
-    direction = 1;
-  int current = last_match;
-  for (int i = 0; i < ed_cfg.numrows; i++) {
-    current += direction;
-    if (current == -1)
-      current = ed_cfg.numrows - 1;
-    else if (current >= ed_cfg.numrows)
-      current = 0;
+// Row `at` changed (or the row before it did), so re-lex until the end
+// state converges with what was there before
+void editor_hl_invalidate(int at)
+{
+  if (ed_cfg.buf->syntax == NULL || at >= ed_cfg.buf->hl_frontier)
+    return;
 
-    struct erow *row = &ed_cfg.rows[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      ed_cfg.cy = current;
-      ed_cfg.cx = editor_row_rx_to_cx(row, match - row->render) + ed_cfg.margin_width;
-      ed_cfg.row_offset = ed_cfg.numrows;
-      break;
+  int bottom = editor_view_to_row(ed_cfg.buf->row_offset + ed_cfg.screenrows);
+  for (int r = at; r < ed_cfg.buf->hl_frontier; r++) {
+    unsigned char old_state = ed_cfg.buf->rows[r].hl_state;
+    editor_lex_any_row(&ed_cfg.buf->rows[r], editor_hl_start_state(r));
+    if (ed_cfg.buf->rows[r].hl_state == old_state)
+      return;
+
+    if (r + 1 >= bottom) {
+      ed_cfg.buf->hl_frontier = r + 1;
+      return;
     }
   }
 }
 
-void editor_find(void)
+void editor_update_syntax(struct erow *row)
 {
-  int saved_cx = ed_cfg.cx;
-  int saved_cy = ed_cfg.cy;
-  int saved_coloff = ed_cfg.col_offset;
-  int saved_rowoff = ed_cfg.row_offset;
-
-  char *query = editor_prompt("\x1b[2mSearch: \x1b[m%s\x1b[2m (Use ESC/Arrows/Enter)\x1b[m", editor_find_callback);
+  if (ed_cfg.buf->syntax)
+    editor_hl_invalidate(row - ed_cfg.buf->rows);
+}
 
-  if (query) {
-    free(query);
-  }
-  else {
-    ed_cfg.cx = saved_cx;
-    ed_cfg.cy = saved_cy;
-    ed_cfg.col_offset = saved_coloff;
-    ed_cfg.row_offset = saved_rowoff;
+int editor_syntax_to_color(int hl)
+{
+  switch (hl) {
+    case HL_COMMENT:
+    case HL_MLCOMMENT: return 36;
+    case HL_KEYWORD1: return 33;
+    case HL_KEYWORD2: return 32;
+    case HL_STRING: return 35;
+    case HL_NUMBER: return 31;
+    default: return 39;
   }
 }
 
-int get_cursor_position(int *rows, int *cols)
+void editor_select_syntax_highlight(void)
 {
-  char buf[32];
-  uint32_t i = 0;
+  ed_cfg.buf->syntax = NULL;
+  ed_cfg.buf->hl_frontier = 0;
+  if (ed_cfg.buf->filename == NULL)
+    return;
 
-  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
-    return -1;
-  
-  while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1)
+  char *ext = strrchr(ed_cfg.buf->filename, '.');
+  char *base = strrchr(ed_cfg.buf->filename, '/');
+  base = base ? base + 1 : ed_cfg.buf->filename;
+
+  for (unsigned int j = 0; j < HL_DB_ENTRIES; j++) {
+    struct editor_syntax *s = &hl_db[j];
+    for (int i = 0; s->filematch[i]; i++) {
+      bool is_ext = s->filematch[i][0] == '.';
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && !strcmp(base, s->filematch[i]))) {
+        ed_cfg.buf->syntax = s;
+        return;
+      }
+    }
+  }
+}
+
+// compression
+
+// A small LZ77 codec in the style of LZ4, used for cold row blocks. The
+// input is a sequence of (literals, match) pairs. Each starts with a token
+// byte: the high nibble is the literal count and the low nibble is the
+// match length minus LZ_MIN_MATCH. A nibble of 15 means more length bytes
+// follow, each adding up to 255. Then come the literals, then a 2 byte
+// little endian offset back into the output. The last sequence is literals
+// only and runs to the end of the input.
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 13
+#define LZ_MAX_OFFSET 65535
+
+// Worst case size of compressing len bytes
+int lz_bound(int len)
+{
+  return len + len / 255 + 16;
+}
+
+uint32_t lz_hash(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+int lz_put_length(char *dst, int cap, int op, int n)
+{
+  for (; n >= 255; n -= 255) {
+    if (op >= cap)
+      return -1;
+    dst[op++] = (char)255;
+  }
+  if (op >= cap)
+    return -1;
+  dst[op++] = n;
+
+  return op;
+}
+
+int lz_emit(char *dst, int cap, int op, const char *lit, int lit_len, 
+  int offset, int match_len)
+{
+  int lit_nib = lit_len < 15 ? lit_len : 15;
+  int mlen = match_len ? match_len - LZ_MIN_MATCH : 0;
+  int match_nib = mlen < 15 ? mlen : 15;
+
+  if (op >= cap)
+    return -1;
+  dst[op++] = (lit_nib << 4) | match_nib;
+  if (lit_len >= 15 && (op = lz_put_length(dst, cap, op, lit_len - 15)) == -1)
+    return -1;
+  if (op + lit_len > cap)
+    return -1;
+  memcpy(&dst[op], lit, lit_len);
+  op += lit_len;
+
+  if (match_len == 0)
+    return op;
+
+  if (op + 2 > cap)
+    return -1;
+  dst[op++] = offset & 0xff;
+  dst[op++] = offset >> 8;
+  if (mlen >= 15 && (op = lz_put_length(dst, cap, op, mlen - 15)) == -1)
+    return -1;
+
+  return op;
+}
+
+// Returns the compressed size, or -1 if it doesn't fit in cap bytes
+int lz_compress(const char *src, int len, char *dst, int cap)
+{
+  int32_t table[1 << LZ_HASH_BITS];
+  for (int j = 0; j < (1 << LZ_HASH_BITS); j++)
+    table[j] = -1;
+
+  int ip = 0;
+  int anchor = 0;
+  int op = 0;
+  while (ip + LZ_MIN_MATCH <= len) {
+    uint32_t v;
+    memcpy(&v, &src[ip], sizeof(v));
+    uint32_t h = lz_hash(v);
+    int ref = table[h];
+    table[h] = ip;
+
+    if (ref < 0 || ip - ref > LZ_MAX_OFFSET || memcmp(&src[ref], &src[ip], LZ_MIN_MATCH)) {
+      ++ip;
+      continue;
+    }
+
+    int match_len = LZ_MIN_MATCH;
+    while (ip + match_len < len && src[ref + match_len] == src[ip + match_len])
+      ++match_len;
+
+    op = lz_emit(dst, cap, op, &src[anchor], ip - anchor, ip - ref, match_len);
+    if (op == -1)
+      return -1;
+    ip += match_len;
+    anchor = ip;
+  }
+
+  return lz_emit(dst, cap, op, &src[anchor], len - anchor, 0, 0);
+}
+
+int lz_get_length(const unsigned char *src, int clen, int *ip, int n)
+{
+  if (n != 15)
+    return n;
+
+  while (*ip < clen) {
+    int b = src[(*ip)++];
+    n += b;
+    if (b != 255)
+      return n;
+  }
+
+  return -1;
+}
+
+// Decompress into exactly rawlen bytes. Returns -1 on corrupt input.
+int lz_decompress(const char *csrc, int clen, char *dst, int rawlen)
+{
+  const unsigned char *src = (const unsigned char *)csrc;
+  int ip = 0;
+  int op = 0;
+
+  while (ip < clen) {
+    int token = src[ip++];
+    int lit_len = lz_get_length(src, clen, &ip, token >> 4);
+    if (lit_len < 0 || ip + lit_len > clen || op + lit_len > rawlen)
+      return -1;
+    memcpy(&dst[op], &src[ip], lit_len);
+    ip += lit_len;
+    op += lit_len;
+
+    if (ip == clen)
+      break;
+
+    if (ip + 2 > clen)
+      return -1;
+    int offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    int match_len = lz_get_length(src, clen, &ip, token & 0x0f);
+    if (match_len < 0 || offset == 0 || offset > op)
+      return -1;
+    match_len += LZ_MIN_MATCH;
+    if (op + match_len > rawlen)
+      return -1;
+
+    // the match may overlap what it's producing, so copy a byte at a time
+    for (int j = 0; j < match_len; j++, op++)
+      dst[op] = dst[op - offset];
+  }
+
+  return op == rawlen ? 0 : -1;
+}
+
+// cold storage
+
+// With -m, rows far from the viewport are packed into blocks of about
+// FEMTO_COLD_BLOCK bytes and compressed. A cold row keeps its size and
+// highlight state but gives up its chars, render and hl buffers; it points
+// at its block and where its text starts in the decompressed data (every
+// row is NUL terminated there, like row->chars). A few recently used blocks
+// stay decompressed in an LRU cache.
+//
+// With -m, files are loaded the same way: their rows start out cold, in
+// uncompressed blocks that point into a read-only mapping of the file (see
+// editor_map_check for when the file changes). Those rows aren't NUL
+// terminated (the newline is still there), so going by row->size is the
+// only safe way to read cold text. Without -m, files are read in.
+//
+// Read-only passes over the buffer (search, save) go through
+// editor_row_text, which reads from the cache without making the row warm
+// again. Anything that edits or draws a row thaws it first.
+
+#define FEMTO_COLD_BLOCK (64 * 1024)
+
+void editor_update_row(struct erow *row);
+void editor_unmap_file(struct file_map *m);
+bool editor_map_check(void);
+
+void editor_cold_lru_unlink(struct cold_block *b)
+{
+  struct cold_store *cs = &ed_cfg.cold;
+
+  if (b->lru_prev)
+    b->lru_prev->lru_next = b->lru_next;
+  else if (cs->lru_head == b)
+    cs->lru_head = b->lru_next;
+  if (b->lru_next)
+    b->lru_next->lru_prev = b->lru_prev;
+  else if (cs->lru_tail == b)
+    cs->lru_tail = b->lru_prev;
+  b->lru_prev = b->lru_next = NULL;
+}
+
+void editor_cold_drop_raw(struct cold_block *b)
+{
+  if (b->raw == NULL)
+    return;
+
+  editor_cold_lru_unlink(b);
+  if (b->raw != b->data) {
+    free(b->raw);
+    ed_cfg.cold.cache_bytes -= b->rawlen;
+  }
+  b->raw = NULL;
+}
+
+void editor_cold_free_block(struct cold_block *b)
+{
+  struct cold_store *cs = &ed_cfg.cold;
+
+  editor_cold_drop_raw(b);
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    cs->blocks = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+
+  cs->compressed_bytes -= b->clen;
+  if (b->map)
+    editor_unmap_file(b->map);
+  else
+    free(b->data);
+  free(b);
+}
+
+// Let go of a cold row's text without thawing it
+void editor_cold_release(struct erow *row)
+{
+  struct cold_block *b = row->cold;
+  if (b == NULL)
+    return;
+
+  row->cold = NULL;
+  row->cold_off = 0;
+  if (--b->live == 0)
+    editor_cold_free_block(b);
+}
+
+// The decompressed contents of a block, via the cache
+char *editor_cold_raw(struct cold_block *b)
+{
+  struct cold_store *cs = &ed_cfg.cold;
+
+  if (b->raw) {
+    editor_cold_lru_unlink(b);
+  }
+  else if (!b->compressed) {
+    b->raw = b->data;
+  }
+  else {
+    // make room first so we don't briefly hold more than the cache allows
+    while (cs->lru_tail && cs->cache_bytes + b->rawlen > cs->cache_cap)
+      editor_cold_drop_raw(cs->lru_tail);
+
+    b->raw = malloc(b->rawlen);
+    if (b->raw == NULL || lz_decompress(b->data, b->clen, b->raw, b->rawlen) == -1)
+      die("cold block");
+    cs->cache_bytes += b->rawlen;
+  }
+
+  b->lru_next = cs->lru_head;
+  if (cs->lru_head)
+    cs->lru_head->lru_prev = b;
+  cs->lru_head = b;
+  if (cs->lru_tail == NULL)
+    cs->lru_tail = b;
+
+  return b->raw;
+}
+
+// The row's text, whether the row is warm or cold. Only warm rows are sure
+// to be NUL terminated, and for cold rows the pointer is only good until the
+// next call.
+char *editor_row_text(struct erow *row)
+{
+  if (row->cold == NULL)
+    return row->chars;
+
+  return editor_cold_raw(row->cold) + row->cold_off;
+}
+
+// Bring a cold row back into the pool so it can be drawn or edited
+void editor_row_thaw(struct erow *row)
+{
+  struct cold_block *b = row->cold;
+  if (b == NULL)
+    return;
+
+  char *text = editor_cold_raw(b) + row->cold_off;
+  row->chars = pool_alloc(&ed_cfg.buf->pool, row->size + 1, &row->chars_cls);
+  memcpy(row->chars, text, row->size);
+  row->chars[row->size] = '\0';
+  editor_cold_release(row);
+
+  editor_update_row(row);
+}
+
+void editor_cold_link_block(struct cold_block *b)
+{
+  struct cold_store *cs = &ed_cfg.cold;
+
+  b->next = cs->blocks;
+  if (cs->blocks)
+    cs->blocks->prev = b;
+  cs->blocks = b;
+  cs->compressed_bytes += b->clen;
+}
+
+// Pack rows [first, last) of buf into one new block
+void editor_cold_freeze_range(struct buffer *buf, int first, int last)
+{
+  if (first >= last)
+    return;
+
+  size_t rawlen = 0;
+  for (int j = first; j < last; j++)
+    rawlen += buf->rows[j].size + 1;
+
+  char *raw = malloc(rawlen);
+  char *packed = malloc(lz_bound(rawlen));
+  struct cold_block *b = calloc(1, sizeof(struct cold_block));
+  if (raw == NULL || packed == NULL || b == NULL)
+    die("malloc");
+
+  // there's at least one row, which lets the compiler see raw gets filled
+  size_t off = 0;
+  int j = first;
+  do {
+    struct erow *row = &buf->rows[j];
+    memcpy(&raw[off], row->chars, row->size + 1);
+
+    pool_free(&buf->pool, row->chars, row->chars_cls);
+    pool_free(&buf->pool, row->render, row->render_cls);
+    pool_free(&buf->pool, row->hl, row->hl_cls);
+    row->chars = row->render = NULL;
+    row->hl = NULL;
+    row->chars_cls = row->render_cls = row->hl_cls = POOL_NONE;
+    row->rsize = 0;
+    row->cold = b;
+    row->cold_off = off;
+    off += row->size + 1;
+  } while (++j < last);
+
+  int clen = lz_compress(raw, rawlen, packed, lz_bound(rawlen));
+  if (clen == -1 || (size_t)clen >= rawlen) {
+    // not worth it, keep the block as is
+    b->data = raw;
+    b->clen = rawlen;
+    free(packed);
+  }
+  else {
+    b->data = realloc(packed, clen);
+    b->clen = clen;
+    b->compressed = true;
+    free(raw);
+  }
+  b->rawlen = rawlen;
+  b->live = last - first;
+  editor_cold_link_block(b);
+}
+
+// Copy warm rows [first, last) of buf into one new uncompressed block, as
+// cold rows in out. The rows in buf are left as they are.
+void editor_cold_copy_range(struct buffer *buf, int first, int last, struct erow *out)
+{
+  if (first >= last)
+    return;
+
+  size_t rawlen = 0;
+  for (int j = first; j < last; j++)
+    rawlen += buf->rows[j].size + 1;
+
+  char *raw = malloc(rawlen);
+  struct cold_block *b = calloc(1, sizeof(struct cold_block));
+  if (raw == NULL || b == NULL)
+    die("malloc");
+
+  size_t off = 0;
+  int j = first;
+  do {
+    struct erow *row = &buf->rows[j];
+    struct erow *copy = &out[j - first];
+    memcpy(&raw[off], row->chars, row->size + 1);
+
+    *copy = *row;
+    copy->chars = copy->render = NULL;
+    copy->hl = NULL;
+    copy->chars_cls = copy->render_cls = copy->hl_cls = POOL_NONE;
+    copy->rsize = 0;
+    copy->cold = b;
+    copy->cold_off = off;
+    off += row->size + 1;
+  } while (++j < last);
+
+  b->data = raw;
+  b->clen = rawlen;
+  b->rawlen = rawlen;
+  b->live = last - first;
+  editor_cold_link_block(b);
+}
+
+// Freeze warm rows in buf from its cold_scan onwards, leaving the rows on
+// and around its screen alone
+void editor_cold_sweep(struct buffer *buf)
+{
+  int keep_first = editor_buffer_view_to_row(buf, buf->row_offset - ed_cfg.screenrows);
+  int keep_last = editor_buffer_view_to_row(buf, buf->row_offset + 2 * ed_cfg.screenrows);
+  int first = -1;
+  size_t bytes = 0;
+
+  for (int j = buf->cold_scan; j < buf->numrows; j++) {
+    struct erow *row = &buf->rows[j];
+    bool eligible = row->cold == NULL && (j < keep_first || j >= keep_last);
+
+    if (!eligible) {
+      if (first != -1)
+        editor_cold_freeze_range(buf, first, j);
+      first = -1;
+      bytes = 0;
+      continue;
+    }
+
+    if (first == -1)
+      first = j;
+    bytes += row->size + 1;
+    if (bytes >= FEMTO_COLD_BLOCK) {
+      editor_cold_freeze_range(buf, first, j + 1);
+      first = -1;
+      bytes = 0;
+    }
+  }
+
+  // a short run at the very end is probably still being loaded
+  if (first != -1 && bytes >= FEMTO_COLD_BLOCK / 4) {
+    editor_cold_freeze_range(buf, first, buf->numrows);
+    first = -1;
+  }
+
+  buf->cold_scan = first != -1 ? first : buf->numrows;
+}
+
+// Called as rows are loaded into buf: freeze the newly loaded rows once the
+// warm ones go over budget
+void editor_cold_check(struct buffer *buf)
+{
+  struct cold_store *cs = &ed_cfg.cold;
+  if (cs->enabled && ed_cfg.row_bytes > cs->warm_limit)
+    editor_cold_sweep(buf);
+}
+
+// Called when idle: rows thawed by scrolling around pile up behind us, so
+// once they go over budget go over every buffer again. The budget is for
+// all of them together, since their pools count their bytes together.
+void editor_cold_idle(void)
+{
+  struct cold_store *cs = &ed_cfg.cold;
+  if (!cs->enabled || ed_cfg.row_bytes <= cs->next_sweep)
+    return;
+
+  for (struct buffer *b = ed_cfg.buffers; b; b = b->next) {
+    b->cold_scan = 0;
+    editor_cold_sweep(b);
+  }
+  // if the rows we must keep warm are over budget on their own, don't
+  // sweep again on every idle tick
+  cs->next_sweep = ed_cfg.row_bytes > cs->warm_limit ? 
+    ed_cfg.row_bytes + cs->warm_limit / 4 : cs->warm_limit;
+}
+
+// Reading cold rows from other threads. The shared cache isn't thread safe,
+// so each reader decompresses into its own buffer, and only reads blocks
+// the cache already holds. The main thread must not touch the rows while
+// readers are running.
+void editor_cold_reader_free(struct cold_reader *rd)
+{
+  free(rd->buf);
+  memset(rd, 0, sizeof(*rd));
+}
+
+const char *editor_cold_read(struct cold_reader *rd, struct erow *row)
+{
+  struct cold_block *b = row->cold;
+  if (b == NULL)
+    return row->chars;
+  if (b->raw)
+    return b->raw + row->cold_off;
+  if (!b->compressed)
+    return b->data + row->cold_off;
+
+  if (rd->block != b) {
+    if (rd->cap < b->rawlen) {
+      free(rd->buf);
+      rd->buf = malloc(b->rawlen);
+      rd->cap = rd->buf ? b->rawlen : 0;
+    }
+    if (rd->buf == NULL || lz_decompress(b->data, b->clen, rd->buf, b->rawlen) == -1) {
+      rd->block = NULL;
+      return "";
+    }
+    rd->block = b;
+  }
+
+  return rd->buf + row->cold_off;
+}
+
+void editor_cold_configure(size_t budget)
+{
+  struct cold_store *cs = &ed_cfg.cold;
+
+  cs->enabled = true;
+  cs->budget = budget;
+  cs->warm_limit = budget / 2;
+  cs->cache_cap = budget / 8;
+  if (cs->cache_cap < 4 * FEMTO_COLD_BLOCK)
+    cs->cache_cap = 4 * FEMTO_COLD_BLOCK;
+  cs->next_sweep = cs->warm_limit;
+}
+
+// row operations
+
+// Convert a byte offset in row->chars into a display column, accounting for
+// tabs and for multi-byte and double-width characters
+int editor_row_cx_to_rx(struct erow *row, int cx)
+{
+  editor_row_thaw(row);
+  int rx = 0;
+
+  if (cx > row->size)
+    cx = row->size;
+
+  if (row->ascii) {
+    for (int j = 0; j < cx; j++) {
+      if (row->chars[j] == '\t')
+        rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+      rx++;
+    }
+
+    return rx;
+  }
+
+  int j = 0;
+  while (j < cx) {
+    uint32_t cp;
+    j += utf8_decode(&row->chars[j], row->size - j, &cp);
+    if (cp == '\t')
+      rx += TAB_STOP - (rx % TAB_STOP);
+    else
+      rx += cp_width(cp);
+  }
+
+  return rx;
+}
+
+int editor_row_rx_to_cx(struct erow *row, int rx)
+{
+  editor_row_thaw(row);
+  int curr_rx = 0;
+  int cx = 0;
+
+  if (row->ascii) {
+    for (cx = 0; cx < row->size; cx++) {
+      if (row->chars[cx] == '\t')
+        curr_rx += (TAB_STOP - 1) - (curr_rx % TAB_STOP);
+      ++curr_rx;
+
+      if (curr_rx > rx)
+        return cx;
+    }
+
+    return cx;
+  }
+
+  while (cx < row->size) {
+    uint32_t cp;
+    int n = utf8_decode(&row->chars[cx], row->size - cx, &cp);
+    if (cp == '\t')
+      curr_rx += TAB_STOP - (curr_rx % TAB_STOP);
+    else
+      curr_rx += cp_width(cp);
+
+    if (curr_rx > rx)
+      return cx;
+    cx += n;
+  }
+
+  return cx;
+}
+
+// Byte offset of the character after the one at `at`. Combining marks are
+// stepped over along with their base character so the cursor never lands
+// between them.
+int editor_row_next_cx(struct erow *row, int at)
+{
+  editor_row_thaw(row);
+  if (at >= row->size)
+    return row->size;
+  if (row->ascii)
+    return at + 1;
+
+  uint32_t cp;
+  at += utf8_decode(&row->chars[at], row->size - at, &cp);
+  while (at < row->size) {
+    int n = utf8_decode(&row->chars[at], row->size - at, &cp);
+    if (cp == '\t' || cp_width(cp) != 0)
+      break;
+    at += n;
+  }
+
+  return at;
+}
+
+int editor_row_prev_cx(struct erow *row, int at)
+{
+  editor_row_thaw(row);
+  if (at <= 0)
+    return 0;
+  if (at > row->size)
+    at = row->size;
+  if (row->ascii)
+    return at - 1;
+
+  // Walk back over continuation bytes, then make sure what we found really
+  // decodes to a sequence ending at `at`. If not, treat it as a stray byte.
+  while (at > 0) {
+    int start = at - 1;
+    while (start > 0 && at - start < 4 &&
+           ((unsigned char)row->chars[start] & 0xc0) == 0x80)
+      --start;
+
+    uint32_t cp;
+    if (start + utf8_decode(&row->chars[start], row->size - start, &cp) != at) {
+      start = at - 1;
+      cp = 0xfffd;
+    }
+    at = start;
+    if (cp == '\t' || cp_width(cp) != 0)
+      break;
+  }
+
+  return at;
+}
+
+// Byte offset in row->render where display column col starts. If col lands
+// in the middle of a double-width character, we return the offset of the
+// next character and set *pad to the number of blank cells to draw instead.
+int editor_row_render_col_to_byte(struct erow *row, int col, int *pad)
+{
+  *pad = 0;
+  if (row->ascii)
+    return col < row->rsize ? col : row->rsize;
+
+  int curr = 0;
+  int j = 0;
+  while (j < row->rsize && curr < col) {
+    uint32_t cp;
+    j += utf8_decode(&row->render[j], row->rsize - j, &cp);
+    curr += cp_width(cp);
+  }
+  // also skip combining marks whose base character scrolled off
+  while (j < row->rsize) {
+    uint32_t cp;
+    int n = utf8_decode(&row->render[j], row->rsize - j, &cp);
+    if (cp_width(cp) != 0)
+      break;
+    j += n;
+  }
+  if (curr > col)
+    *pad = curr - col;
+
+  return j;
+}
+
+// Build row->render from row->chars
+void editor_render_row(struct buffer *buf, struct erow *row)
+{
+  int tabs = 0;
+  for (int j = 0; j < row->size; j++) {
+    if (row->chars[j] == '\t')
+      ++tabs;
+  }
+
+  row->ascii = utf8_is_ascii(row->chars, row->size);
+
+  int idx = 0;
+  if (row->ascii) {
+    row->render = pool_reserve(&buf->pool, row->render, &row->render_cls,
+      row->size + tabs*(TAB_STOP - 1) + 1);
+
+    for (int j = 0; j < row->size; j++) {
+      char c = row->chars[j];
+      if (c == '\t') {
+        row->render[idx++] = ' ';
+        while (idx % TAB_STOP != 0)
+          row->render[idx++] = ' ';
+      }
+      else {
+        row->render[idx++] = iscntrl(c) ? '?' : c;
+      }
+    }
+  }
+  else {
+    // A stray byte turns into a 3 byte U+FFFD, which is the worst case
+    row->render = pool_reserve(&buf->pool, row->render, &row->render_cls,
+      row->size * 3 + tabs*(TAB_STOP - 1) + 1);
+
+    int col = 0;
+    int j = 0;
+    while (j < row->size) {
+      uint32_t cp;
+      int n = utf8_decode(&row->chars[j], row->size - j, &cp);
+      if (cp == '\t') {
+        do {
+          row->render[idx++] = ' ';
+          ++col;
+        } while (col % TAB_STOP != 0);
+      }
+      else if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0)) {
+        row->render[idx++] = '?';
+        ++col;
+      }
+      else if (cp == 0xfffd && n == 1) {
+        memcpy(&row->render[idx], "\xef\xbf\xbd", 3);
+        idx += 3;
+        ++col;
+      }
+      else {
+        memcpy(&row->render[idx], &row->chars[j], n);
+        idx += n;
+        col += cp_width(cp);
+      }
+      j += n;
+    }
+  }
+
+  row->render[idx] = '\0';
+  row->rsize = idx;
+}
+
+void editor_update_row(struct erow *row)
+{
+  editor_render_row(ed_cfg.buf, row);
+  editor_update_syntax(row);
+}
+
+// Insert a row into buf without telling anyone, for loading. Rows below it
+// that were lexed need lexing again, which is up to the caller.
+void editor_insert_row_quiet(struct buffer *buf, int at, const char *s, size_t len)
+{
+  if (buf->numrows == buf->rows_cap) {
+    int cap = buf->rows_cap ? buf->rows_cap * 2 : 64;
+    struct erow *rows = realloc(buf->rows, sizeof(struct erow) * cap);
+    if (rows == NULL)
+      die("realloc");
+    buf->rows = rows;
+    buf->rows_cap = cap;
+  }
+  memmove(&buf->rows[at + 1], &buf->rows[at], 
+    sizeof(struct erow) * (buf->numrows - at));
+
+  buf->rows[at].size = len;
+  buf->rows[at].chars = pool_alloc(&buf->pool, len + 1, 
+    &buf->rows[at].chars_cls);
+  memcpy(buf->rows[at].chars, s, len);
+  buf->rows[at].chars[len] = '\0';
+
+  buf->rows[at].rsize = 0;
+  buf->rows[at].render = NULL;
+  buf->rows[at].render_cls = POOL_NONE;
+  buf->rows[at].hl = NULL;
+  buf->rows[at].hl_cls = POOL_NONE;
+  buf->rows[at].cold = NULL;
+  buf->rows[at].cold_off = 0;
+  // An empty row leaves the state it started in unchanged, so that's what
+  // we compare against when deciding whether the rows below need re-lexing
+  buf->rows[at].hl_state = at > 0 ? buf->rows[at - 1].hl_state : HL_STATE_NORMAL;
+  if (at < buf->hl_frontier)
+    buf->hl_frontier++;
+  editor_render_row(buf, &buf->rows[at]);
+
+  buf->numrows++;
+}
+
+void editor_insert_row(int at, char *s, size_t len)
+{
+  if (at < 0 || at > ed_cfg.buf->numrows)
+    return;
+
+  editor_record_edit(EDIT_INSERT_ROW, at, 0, s, len);
+  editor_insert_row_quiet(ed_cfg.buf, at, s, len);
+  editor_update_syntax(&ed_cfg.buf->rows[at]);
+  ed_cfg.buf->dirty = true;
+}
+
+void editor_free_row(struct erow *row)
+{
+  editor_cold_release(row);
+  pool_free(&ed_cfg.buf->pool, row->render, row->render_cls);
+  pool_free(&ed_cfg.buf->pool, row->chars, row->chars_cls);
+  pool_free(&ed_cfg.buf->pool, row->hl, row->hl_cls);
+}
+
+// Throw away every row in b. The pool is the buffer's own, so its
+// memory goes all at once; only cold rows have anything to hand back, their
+// hold on blocks that clips and other buffers can share.
+void editor_free_rows(struct buffer *b)
+{
+  for (int j = 0; j < b->numrows; j++)
+    editor_cold_release(&b->rows[j]);
+  pool_destroy(&b->pool);
+  free(b->rows);
+  b->rows = NULL;
+  b->rows_cap = 0;
+  b->numrows = 0;
+  b->hl_frontier = 0;
+  b->cold_scan = 0;
+}
+
+void editor_del_row(int at)
+{
+  if (at < 0 || at >= ed_cfg.buf->numrows)
+    return;
+
+  editor_row_thaw(&ed_cfg.buf->rows[at]);
+  editor_record_edit(EDIT_DEL_ROW, at, 0, ed_cfg.buf->rows[at].chars, 
+    ed_cfg.buf->rows[at].size);
+  editor_free_row(&ed_cfg.buf->rows[at]);
+  memmove(&ed_cfg.buf->rows[at], &ed_cfg.buf->rows[at + 1], 
+    sizeof(struct erow) * (ed_cfg.buf->numrows - at - 1));
+  --ed_cfg.buf->numrows;
+  ed_cfg.buf->dirty = true;
+
+  if (at < ed_cfg.buf->hl_frontier) {
+    ed_cfg.buf->hl_frontier--;
+    if (at < ed_cfg.buf->numrows)
+      editor_hl_invalidate(at);
+  }
+}
+
+void editor_row_insert_char(struct erow *row, int at, int c) 
+{
+  editor_row_thaw(row);
+  if (at < 0 || at > row->size)
+    at = row->size;
+  char ch = c;
+  editor_record_edit(EDIT_INSERT_TEXT, row - ed_cfg.buf->rows, at, &ch, 1);
+  row->chars = pool_realloc(&ed_cfg.buf->pool, row->chars, &row->chars_cls, 
+    row->size + 2);
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  row->size++;
+  row->chars[at] = c;
+
+  editor_update_row(row);
+  ed_cfg.buf->dirty = true;
+}
+
+void editor_row_insert_str(struct erow *row, int at, const char *s, size_t len)
+{
+  editor_row_thaw(row);
+  if (at < 0 || at > row->size)
+    at = row->size;
+  editor_record_edit(EDIT_INSERT_TEXT, row - ed_cfg.buf->rows, at, s, len);
+  row->chars = pool_realloc(&ed_cfg.buf->pool, row->chars, &row->chars_cls,
+    row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editor_update_row(row);
+  ed_cfg.buf->dirty = true;
+}
+
+void editor_row_append_str(struct erow *row, char *s, size_t len)
+{
+  editor_row_insert_str(row, row->size, s, len);
+}
+
+void editor_row_del_str(struct erow *row, int at, int len)
+{
+  if (at < 0 || at >= row->size || len <= 0)
+    return;
+  editor_row_thaw(row);
+  if (len > row->size - at)
+    len = row->size - at;
+  editor_record_edit(EDIT_DEL_TEXT, row - ed_cfg.buf->rows, at, &row->chars[at], len);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editor_update_row(row);
+  ed_cfg.buf->dirty = true;
+}
+
+void editor_row_del_char(struct erow *row, int at)
+{
+  if (at < 0 || at >= row->size)
+    return;
+  editor_row_thaw(row);
+  editor_record_edit(EDIT_DEL_TEXT, row - ed_cfg.buf->rows, at, &row->chars[at], 1);
+  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+  --row->size;
+  editor_update_row(row);
+  ed_cfg.buf->dirty = true;
+}
+
+// Clips and bulk row edits. Moving a big block of lines one row at a time
+// would memmove the row array once per line and copy every byte; instead a
+// clip holds cold copies of the rows, sharing the blocks of rows that are
+// cold already, and the row array is opened or closed once for the whole
+// range. Putting a clip back is still linear in the number of rows (each
+// row struct is copied, and the filter and line index look at each one),
+// just not in the number of bytes. Taking one copies the text of the rows
+// that are warm.
+
+void editor_update_row(struct erow *row);
+
+struct clip *editor_clip_new(int count)
+{
+  struct clip *c = malloc(sizeof(struct clip));
+  if (c == NULL)
+    die("malloc");
+  c->rows = malloc(sizeof(struct erow) * (count > 0 ? count : 1));
+  if (c->rows == NULL)
+    die("malloc");
+  c->count = count;
+  c->refs = 1;
+  c->id = ++ed_cfg.clip_ids;
+
+  return c;
+}
+
+void editor_clip_unref(struct clip *c)
+{
+  if (c == NULL || --c->refs > 0)
+    return;
+
+  for (int j = 0; j < c->count; j++)
+    editor_free_row(&c->rows[j]);
+  free(c->rows);
+  free(c);
+}
+
+// Take rows [first, last) of the buffer. Cold rows are shared. Warm ones
+// are copied, a block's worth at a time, into plain blocks the clip rows
+// point at, and stay warm in the buffer: no compressing, and nothing on
+// screen has to be thawed again.
+struct clip *editor_clip_take(int first, int last)
+{
+  struct buffer *buf = ed_cfg.buf;
+  struct clip *c = editor_clip_new(last - first);
+  int run = -1;
+  size_t bytes = 0;
+  for (int j = first; j < last; j++) {
+    struct erow *row = &buf->rows[j];
+    if (row->cold) {
+      if (run != -1)
+        editor_cold_copy_range(buf, run, j, &c->rows[run - first]);
+      run = -1;
+      bytes = 0;
+      c->rows[j - first] = *row;
+      row->cold->live++;
+      continue;
+    }
+
+    if (run == -1)
+      run = j;
+    bytes += row->size + 1;
+    if (bytes >= FEMTO_COLD_BLOCK) {
+      editor_cold_copy_range(buf, run, j + 1, &c->rows[run - first]);
+      run = -1;
+      bytes = 0;
+    }
+  }
+  if (run != -1)
+    editor_cold_copy_range(buf, run, last, &c->rows[run - first]);
+
+  return c;
+}
+
+// A copy of the bytes [from, to) of row j in the clip, which (unlike the
+// row text of a cold row) stays put while the buffer is being edited
+char *editor_clip_text(struct clip *c, int j, int from, int to, int *len)
+{
+  struct erow *row = &c->rows[j];
+  if (to > row->size)
+    to = row->size;
+  if (from > to)
+    from = to;
+
+  char *text = malloc(to - from + 1);
+  if (text == NULL)
+    die("malloc");
+  memcpy(text, editor_row_text(row) + from, to - from);
+  text[to - from] = '\0';
+  *len = to - from;
+
+  return text;
+}
+
+// Make room for n rows at at, moving the rest of the array only once
+void editor_rows_open_gap(int at, int n)
+{
+  struct buffer *buf = ed_cfg.buf;
+  if (buf->numrows + n > buf->rows_cap) {
+    int cap = buf->rows_cap ? buf->rows_cap : 64;
+    while (cap < buf->numrows + n)
+      cap *= 2;
+    struct erow *rows = realloc(buf->rows, sizeof(struct erow) * cap);
+    if (rows == NULL)
+      die("realloc");
+    buf->rows = rows;
+    buf->rows_cap = cap;
+  }
+
+  memmove(&buf->rows[at + n], &buf->rows[at], 
+    sizeof(struct erow) * (buf->numrows - at));
+  buf->numrows += n;
+}
+
+// Insert rows [from, to) of the clip at at. No text is copied, only the
+// row structs: the new rows are cold and share the clip's blocks.
+void editor_clip_put(struct clip *c, int from, int to, int at)
+{
+  int n = to - from;
+  if (n <= 0 || at < 0 || at > ed_cfg.buf->numrows)
+    return;
+
+  editor_rows_open_gap(at, n);
+  for (int j = 0; j < n; j++) {
+    ed_cfg.buf->rows[at + j] = c->rows[from + j];
+    ed_cfg.buf->rows[at + j].cold->live++;
+  }
+  ed_cfg.buf->dirty = true;
+
+  // everything from here down gets lexed again when it's next drawn
+  if (at < ed_cfg.buf->hl_frontier)
+    ed_cfg.buf->hl_frontier = at;
+
+  editor_record_bulk(EDIT_INSERT_ROWS, at, n, c, from);
+}
+
+// Insert n rows at at from packed text: each row's length as a uint32_t
+// and then its bytes, the way the swap file keeps them
+void editor_insert_rows_packed(int at, int n, const char *p)
+{
+  if (n <= 0 || at < 0 || at > ed_cfg.buf->numrows)
+    return;
+
+  editor_rows_open_gap(at, n);
+  if (at < ed_cfg.buf->hl_frontier)
+    ed_cfg.buf->hl_frontier = at;
+
+  for (int j = at; j < at + n; j++) {
+    uint32_t size;
+    memcpy(&size, p, sizeof(size));
+    p += sizeof(size);
+
+    struct erow *row = &ed_cfg.buf->rows[j];
+    memset(row, 0, sizeof(*row));
+    row->size = size;
+    row->chars = pool_alloc(&ed_cfg.buf->pool, size + 1, &row->chars_cls);
+    memcpy(row->chars, p, size);
+    row->chars[size] = '\0';
+    row->render_cls = row->hl_cls = POOL_NONE;
+    row->hl_state = HL_STATE_NORMAL;
+    editor_update_row(row);
+    p += size;
+  }
+  ed_cfg.buf->dirty = true;
+
+  editor_record_bulk(EDIT_INSERT_ROWS, at, n, NULL, 0);
+}
+
+void editor_del_rows(int at, int n)
+{
+  if (n <= 0 || at < 0 || at + n > ed_cfg.buf->numrows)
+    return;
+
+  // the undo journal keeps the rows, the swap file only needs the range
+  struct clip *c = editor_undo_recording() ? editor_clip_take(at, at + n) : NULL;
+  editor_record_bulk(EDIT_DEL_ROWS, at, n, c, 0);
+  editor_clip_unref(c);
+
+  for (int j = at; j < at + n; j++)
+    editor_free_row(&ed_cfg.buf->rows[j]);
+  memmove(&ed_cfg.buf->rows[at], &ed_cfg.buf->rows[at + n], 
+    sizeof(struct erow) * (ed_cfg.buf->numrows - at - n));
+  ed_cfg.buf->numrows -= n;
+  ed_cfg.buf->dirty = true;
+
+  if (at < ed_cfg.buf->hl_frontier)
+    ed_cfg.buf->hl_frontier = at;
+}
+
+// True if perm holds each of 0 to n - 1 exactly once
+bool editor_permutation_valid(const int *perm, int n)
+{
+  bool *seen = calloc(n > 0 ? n : 1, sizeof(bool));
+  if (seen == NULL)
+    return false;
+
+  bool ok = true;
+  for (int j = 0; j < n && ok; j++) {
+    ok = perm[j] >= 0 && perm[j] < n && !seen[perm[j]];
+    if (ok)
+      seen[perm[j]] = true;
+  }
+  free(seen);
+
+  return ok;
+}
+
+// Reorder the n rows from at so that row at + j is what was at + perm[j].
+// Only the row structs move.
+void editor_rows_permute(int at, int n, const int *perm)
+{
+  if (n <= 0 || at < 0 || at + n > ed_cfg.buf->numrows)
+    return;
+
+  struct erow *old = malloc(sizeof(struct erow) * n);
+  if (old == NULL)
+    die("malloc");
+
+  editor_record_edit(EDIT_PERMUTE, at, 0, (const char *)perm, sizeof(int) * n);
+  memcpy(old, &ed_cfg.buf->rows[at], sizeof(struct erow) * n);
+  for (int j = 0; j < n; j++)
+    ed_cfg.buf->rows[at + j] = old[perm[j]];
+  free(old);
+  ed_cfg.buf->dirty = true;
+
+  if (at < ed_cfg.buf->hl_frontier)
+    ed_cfg.buf->hl_frontier = at;
+}
+
+// undo
+
+// The undo journal is a doubly linked list of small operations recorded by
+// the row primitives, oldest first. ed_cfg.buf->undo.cur is the last operation
+// that is currently applied; everything after it can be redone. Every
+// keypress gets a new group id and undo/redo work a group at a time.
+//
+// Entries only carry text when they need it: a deletion keeps the bytes it
+// removed, while an insertion just remembers where and how much and copies
+// the text out of the row when it gets undone. Consecutive typed characters
+// (or backspaces) extend the previous entry instead of adding a new one.
+// Once the journal goes over its byte budget, the oldest groups are dropped.
+
+// A clip's rows count against the budget, but not the text in the blocks
+// they share
+void editor_undo_set_clip(struct undo_entry *e, struct clip *c)
+{
+  if (e->clip)
+    ed_cfg.buf->undo.bytes -= sizeof(struct erow) * e->clip->count;
+  editor_clip_unref(e->clip);
+  e->clip = c;
+  if (c) {
+    c->refs++;
+    ed_cfg.buf->undo.bytes += sizeof(struct erow) * c->count;
+  }
+}
+
+void editor_undo_free_entry(struct undo_entry *e)
+{
+  editor_undo_set_clip(e, NULL);
+  ed_cfg.buf->undo.bytes -= sizeof(*e) + e->cap;
+  free(e->text);
+  free(e);
+}
+
+void editor_undo_clear(struct buffer *b)
+{
+  struct undo_entry *e = b->undo.head;
+  while (e) {
+    struct undo_entry *next = e->next;
+    editor_clip_unref(e->clip);
+    free(e->text);
+    free(e);
+    e = next;
+  }
+
+  b->undo.head = NULL;
+  b->undo.tail = NULL;
+  b->undo.cur = NULL;
+  b->undo.bytes = 0;
+  b->undo.saved_group = 0;
+  b->undo.dropped_group = -1;
+}
+
+// Make room for n bytes of text in the entry
+bool editor_undo_reserve(struct undo_entry *e, int n)
+{
+  if (n <= e->cap)
+    return true;
+
+  int cap = e->cap ? e->cap : 16;
+  while (cap < n)
+    cap *= 2;
+  char *text = realloc(e->text, cap);
+  if (text == NULL)
+    return false;
+
+  ed_cfg.buf->undo.bytes += cap - e->cap;
+  e->text = text;
+  e->cap = cap;
+
+  return true;
+}
+
+void editor_undo_drop_text(struct undo_entry *e)
+{
+  ed_cfg.buf->undo.bytes -= e->cap;
+  free(e->text);
+  e->text = NULL;
+  e->cap = 0;
+}
+
+// Forget everything that could have been redone
+void editor_undo_truncate(void)
+{
+  struct undo_entry *e = ed_cfg.buf->undo.cur ? ed_cfg.buf->undo.cur->next : ed_cfg.buf->undo.head;
+  while (e) {
+    struct undo_entry *next = e->next;
+    if (e->group == ed_cfg.buf->undo.saved_group)
+      ed_cfg.buf->undo.saved_group = -1;
+    editor_undo_free_entry(e);
+    e = next;
+  }
+
+  if (ed_cfg.buf->undo.cur)
+    ed_cfg.buf->undo.cur->next = NULL;
+  else
+    ed_cfg.buf->undo.head = NULL;
+  ed_cfg.buf->undo.tail = ed_cfg.buf->undo.cur;
+}
+
+// Drop whole groups from the old end until we fit in the budget again
+void editor_undo_enforce_budget(void)
+{
+  while (ed_cfg.buf->undo.head && ed_cfg.buf->undo.bytes > ed_cfg.buf->undo.budget) {
+    long group = ed_cfg.buf->undo.head->group;
+    if (group == ed_cfg.buf->undo.group)
+      ed_cfg.buf->undo.dropped_group = group;
+    // the state with nothing left to undo moves up to the end of this
+    // group: if we saved there it's now 0, and if we saved before it, it's
+    // gone
+    if (ed_cfg.buf->undo.saved_group == group)
+      ed_cfg.buf->undo.saved_group = 0;
+    else if (ed_cfg.buf->undo.saved_group == 0)
+      ed_cfg.buf->undo.saved_group = -1;
+
+    while (ed_cfg.buf->undo.head && ed_cfg.buf->undo.head->group == group) {
+      struct undo_entry *e = ed_cfg.buf->undo.head;
+      ed_cfg.buf->undo.head = e->next;
+      if (ed_cfg.buf->undo.cur == e)
+        ed_cfg.buf->undo.cur = NULL;
+      editor_undo_free_entry(e);
+    }
+
+    if (ed_cfg.buf->undo.head)
+      ed_cfg.buf->undo.head->prev = NULL;
+    else
+      ed_cfg.buf->undo.tail = NULL;
+  }
+}
+
+// Try to fold a typed character (one byte, or the few of a multibyte one)
+// into the entry before it
+bool editor_undo_coalesce(int type, int row, int at, const char *text, int len)
+{
+  struct undo_entry *e = ed_cfg.buf->undo.cur;
+  if (e == NULL || !ed_cfg.buf->undo.typing || !e->typing || e->type != type ||
+      e->row != row || e->group != ed_cfg.buf->undo.group - 1 || len > 4)
+    return false;
+
+  if (type == EDIT_INSERT_TEXT && at == e->at + e->len) {
+    e->len += len;
+  }
+  else if (type == EDIT_DEL_TEXT && at + len == e->at) {
+    // backspace: the new bytes go in front of what we already have
+    if (!editor_undo_reserve(e, e->len + len))
+      return false;
+    memmove(e->text + len, e->text, e->len);
+    memcpy(e->text, text, len);
+    e->len += len;
+    e->at = at;
+  }
+  else if (type == EDIT_DEL_TEXT && at == e->at) {
+    if (!editor_undo_reserve(e, e->len + len))
+      return false;
+    memcpy(e->text + e->len, text, len);
+    e->len += len;
+  }
+  else {
+    return false;
+  }
+
+  // keep going with the group we merged into
+  ed_cfg.buf->undo.group = e->group;
+
+  return true;
+}
+
+bool editor_undo_recording(void)
+{
+  return !ed_cfg.buf->undo.suspended && 
+    ed_cfg.buf->undo.group != ed_cfg.buf->undo.dropped_group;
+}
+
+// Whether an entry carrying len bytes fits in the budget at all. One that
+// doesn't takes the whole history with it, itself included.
+bool editor_undo_fits(size_t len)
+{
+  size_t cap = 16;
+  while (cap < len)
+    cap *= 2;
+
+  return !editor_undo_recording() || sizeof(struct undo_entry) + cap <= ed_cfg.buf->undo.budget;
+}
+
+struct undo_entry *editor_undo_new_entry(int type, int row, int at, int len)
+{
+  struct undo_entry *e = calloc(1, sizeof(struct undo_entry));
+  if (e == NULL)
+    return NULL;
+  ed_cfg.buf->undo.bytes += sizeof(*e);
+
+  e->group = ed_cfg.buf->undo.group;
+  e->typing = ed_cfg.buf->undo.typing;
+  e->type = type;
+  e->row = row;
+  e->at = at;
+  e->len = len;
+  e->cx = ed_cfg.buf->undo.cx;
+  e->cy = ed_cfg.buf->undo.cy;
+  e->cx_after = e->cx;
+  e->cy_after = e->cy;
+
+  return e;
+}
+
+void editor_undo_link_entry(struct undo_entry *e)
+{
+  e->prev = ed_cfg.buf->undo.tail;
+  if (ed_cfg.buf->undo.tail)
+    ed_cfg.buf->undo.tail->next = e;
+  else
+    ed_cfg.buf->undo.head = e;
+  ed_cfg.buf->undo.tail = e;
+  ed_cfg.buf->undo.cur = e;
+
+  editor_undo_enforce_budget();
+}
+
+// Called through editor_record_edit. For deletions, text is the bytes (or
+// the row) being removed; for insertions it is ignored.
+void editor_undo_record(int type, int row, int at, const char *text, int len)
+{
+  if (!editor_undo_recording())
+    return;
+
+  editor_undo_truncate();
+  if (editor_undo_coalesce(type, row, at, text, len))
+    return;
+
+  struct undo_entry *e = editor_undo_new_entry(type, row, at, len);
+  if (e == NULL)
+    return;
+  if ((type == EDIT_DEL_TEXT || type == EDIT_DEL_ROW || type == EDIT_PERMUTE) &&
+      len > 0) {
+    if (!editor_undo_reserve(e, len)) {
+      editor_undo_free_entry(e);
+      return;
+    }
+    memcpy(e->text, text, len);
+  }
+
+  editor_undo_link_entry(e);
+}
+
+// Called through editor_record_bulk. Like single rows, deleted ranges keep
+// their rows (a clip, so that's cheap) and inserted ones only their extent.
+void editor_undo_record_bulk(int type, int row, int count, struct clip *clip)
+{
+  if (!editor_undo_recording())
+    return;
+
+  editor_undo_truncate();
+  struct undo_entry *e = editor_undo_new_entry(type, row, 0, count);
+  if (e == NULL)
+    return;
+  editor_undo_set_clip(e, clip);
+
+  editor_undo_link_entry(e);
+}
+
+// Start a new group for the command about to run. Typing commands may be
+// merged into the previous one if nothing else happened in between.
+void editor_undo_begin(bool typing)
+{
+  ed_cfg.buf->undo.group++;
+  ed_cfg.buf->undo.typing = typing;
+  ed_cfg.buf->undo.cx = ed_cfg.buf->cx - ed_cfg.buf->margin_width;
+  ed_cfg.buf->undo.cy = ed_cfg.buf->cy;
+}
+
+// Remember where the command left the cursor, for redo
+void editor_undo_end(void)
+{
+  struct undo_entry *e = ed_cfg.buf->undo.cur;
+  if (e && e->group == ed_cfg.buf->undo.group) {
+    e->cx_after = ed_cfg.buf->cx - ed_cfg.buf->margin_width;
+    e->cy_after = ed_cfg.buf->cy;
+  }
+}
+
+void editor_undo_set_cursor(int cx, int cy)
+{
+  editor_set_margin_width();
+  ed_cfg.buf->cy = cy < ed_cfg.buf->numrows ? cy : ed_cfg.buf->numrows;
+  if (ed_cfg.buf->cy < 0)
+    ed_cfg.buf->cy = 0;
+  int size = ed_cfg.buf->cy < ed_cfg.buf->numrows ? ed_cfg.buf->rows[ed_cfg.buf->cy].size : 0;
+  ed_cfg.buf->cx = (cx < size ? cx : size) + ed_cfg.buf->margin_width;
+}
+
+void editor_undo_apply(struct undo_entry *e, bool undo)
+{
+  bool bulk = e->type == EDIT_INSERT_ROWS || e->type == EDIT_DEL_ROWS ||
+    e->type == EDIT_PERMUTE;
+  struct erow *row = e->row < ed_cfg.buf->numrows ? &ed_cfg.buf->rows[e->row] : NULL;
+  if (row && !bulk)
+    editor_row_thaw(row);
+  bool insert = e->type == EDIT_INSERT_TEXT || e->type == EDIT_INSERT_ROW ||
+    e->type == EDIT_INSERT_ROWS;
+
+  // undoing an insertion is the only time we need to copy its text
+  if (undo && e->type == EDIT_INSERT_TEXT && row) {
+    if (!editor_undo_reserve(e, e->len))
+      return;
+    memcpy(e->text, &row->chars[e->at], e->len);
+  }
+  else if (undo && e->type == EDIT_INSERT_ROW && row) {
+    e->len = row->size;
+    if (!editor_undo_reserve(e, e->len))
+      return;
+    memcpy(e->text, row->chars, e->len);
+  }
+
+  switch (e->type) {
+    case EDIT_INSERT_TEXT:
+    case EDIT_DEL_TEXT:
+      if (row == NULL)
+        return;
+      if (undo == insert)
+        editor_row_del_str(row, e->at, e->len);
+      else
+        editor_row_insert_str(row, e->at, e->text, e->len);
+      break;
+    case EDIT_INSERT_ROW:
+    case EDIT_DEL_ROW:
+      if (undo == insert)
+        editor_del_row(e->row);
+      else
+        editor_insert_row(e->row, e->text ? e->text : "", e->len);
+      break;
+    case EDIT_INSERT_ROWS:
+    case EDIT_DEL_ROWS:
+      if (undo == insert) {
+        if (insert) {
+          struct clip *c = editor_clip_take(e->row, e->row + e->len);
+          editor_undo_set_clip(e, c);
+          editor_clip_unref(c);
+        }
+        editor_del_rows(e->row, e->len);
+      }
+      else if (e->clip) {
+        editor_clip_put(e->clip, 0, e->clip->count, e->row);
+      }
+      break;
+    case EDIT_PERMUTE: {
+      int n = e->len / sizeof(int);
+      int *perm = (int *)e->text;
+      if (!undo) {
+        editor_rows_permute(e->row, n, perm);
+        break;
+      }
+
+      int *inverse = malloc(sizeof(int) * n);
+      if (inverse == NULL)
+        return;
+      for (int j = 0; j < n; j++)
+        inverse[perm[j]] = j;
+      editor_rows_permute(e->row, n, inverse);
+      free(inverse);
+      break;
+    }
+  }
+
+  if (!undo && insert) {
+    editor_undo_drop_text(e);
+    editor_undo_set_clip(e, NULL);
+  }
+}
+
+void editor_undo_mark_saved(void)
+{
+  ed_cfg.buf->undo.saved_group = ed_cfg.buf->undo.cur ? ed_cfg.buf->undo.cur->group : 0;
+}
+
+void editor_undo_update_dirty(void)
+{
+  long group = ed_cfg.buf->undo.cur ? ed_cfg.buf->undo.cur->group : 0;
+  ed_cfg.buf->dirty = group != ed_cfg.buf->undo.saved_group;
+}
+
+void editor_undo(void)
+{
+  struct undo_entry *e = ed_cfg.buf->undo.cur;
+  if (e == NULL) {
+    editor_set_status_message("Nothing to undo");
+    return;
+  }
+
+  long group = e->group;
+  int cx = e->cx, cy = e->cy;
+  ed_cfg.buf->undo.suspended++;
+  while (e && e->group == group) {
+    editor_undo_apply(e, true);
+    cx = e->cx;
+    cy = e->cy;
+    e = e->prev;
+  }
+  ed_cfg.buf->undo.suspended--;
+  ed_cfg.buf->undo.cur = e;
+
+  editor_undo_set_cursor(cx, cy);
+  editor_undo_update_dirty();
+}
+
+void editor_redo(void)
+{
+  struct undo_entry *e = ed_cfg.buf->undo.cur ? ed_cfg.buf->undo.cur->next : ed_cfg.buf->undo.head;
+  if (e == NULL) {
+    editor_set_status_message("Nothing to redo");
+    return;
+  }
+
+  long group = e->group;
+  ed_cfg.buf->undo.suspended++;
+  while (e && e->group == group) {
+    editor_undo_apply(e, false);
+    ed_cfg.buf->undo.cur = e;
+    e = e->next;
+  }
+  ed_cfg.buf->undo.suspended--;
+
+  editor_undo_set_cursor(ed_cfg.buf->undo.cur->cx_after, ed_cfg.buf->undo.cur->cy_after);
+  editor_undo_update_dirty();
+}
+
+// swap file
+
+// Unsaved edits are appended to a swap file next to the file being edited
+// (.name.fswp) as small records, the same operations the undo journal sees.
+// Records collect in memory and get written and fsynced from the event loop
+// at most once per FEMTO_SWAP_SYNC_MS, so the cost follows the typing, not
+// the size of the file. Saving resets the swap file to just its header and
+// quitting removes it. If femto dies, the next open of the file finds the
+// records and offers to replay them over what's on disk. The rows of a clip
+// are written once, the first time some of them are put into the buffer,
+// and every insertion from the clip after that names it by its id.
+
+#define FEMTO_SWAP_MAGIC "femtoswp"
+#define FEMTO_SWAP_VERSION 2
+#define FEMTO_SWAP_CLIP 0x80 // a record type of its own: row is the id
+#define FEMTO_SWAP_ALL 0x81  // len rows follow that replace the whole buffer
+#define FEMTO_SWAP_SYNC_MS 1000
+#define FEMTO_SWAP_BATCH (64 * 1024)
+
+struct swap_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+struct swap_record {
+  uint8_t type;
+  uint8_t reserved[3];
+  uint32_t row;
+  uint32_t at;
+  uint32_t len;
+  uint32_t clip; // EDIT_INSERT_ROWS: the rows are the clip's from at on
+};
+
+long long monotonic_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+char *editor_swap_path(const char *filename)
+{
+  const char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  const char *base = filename + dirlen;
+
+  size_t len = strlen(filename) + 8;
+  char *path = malloc(len);
+  snprintf(path, len, "%.*s.%s.fswp", dirlen, filename, base);
+
+  return path;
+}
+
+void editor_swap_fill_header(struct buffer *b, struct swap_header *hdr)
+{
+  struct stat st;
+
+  memset(hdr, 0, sizeof(*hdr));
+  memcpy(hdr->magic, FEMTO_SWAP_MAGIC, sizeof(hdr->magic));
+  hdr->version = FEMTO_SWAP_VERSION;
+  if (b->filename && stat(b->filename, &st) == 0) {
+    hdr->size = st.st_size;
+    hdr->mtime_sec = st.st_mtim.tv_sec;
+    hdr->mtime_nsec = st.st_mtim.tv_nsec;
+  }
+}
+
+// Write out whatever has been batched up, and fsync if asked to
+void editor_swap_flush(struct buffer *b, bool sync)
+{
+  struct swap_file *sw = &b->swap;
+  if (sw->fd == -1)
+    return;
+
+  size_t off = 0;
+  while (off < sw->pending.len) {
+    ssize_t n = write(sw->fd, sw->pending.b + off, sw->pending.len - off);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      editor_set_status_message("Swap file write failed: %s", strerror(errno));
+      break;
+    }
+    off += n;
+  }
+  if (off > 0)
+    sw->unsynced = true;
+  sw->pending.len = 0;
+
+  if (sync && sw->unsynced) {
+    fdatasync(sw->fd);
+    sw->unsynced = false;
+    sw->last_sync = monotonic_ms();
+  }
+}
+
+// Start over with an empty journal describing the file as it is on disk now
+void editor_swap_reset(struct buffer *b)
+{
+  struct swap_file *sw = &b->swap;
+  if (sw->fd == -1)
+    return;
+
+  struct swap_header hdr;
+  editor_swap_fill_header(b, &hdr);
+  sw->pending.len = 0;
+  sw->nclips = 0;
+  if (ftruncate(sw->fd, 0) == -1 || lseek(sw->fd, 0, SEEK_SET) == -1 ||
+      write(sw->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    editor_set_status_message("Swap file reset failed: %s", strerror(errno));
+    return;
+  }
+  fdatasync(sw->fd);
+  sw->unsynced = false;
+  sw->last_sync = monotonic_ms();
+}
+
+void editor_swap_close(struct buffer *b, bool remove)
+{
+  struct swap_file *sw = &b->swap;
+  if (sw->fd == -1)
+    return;
+
+  if (remove)
+    unlink(sw->path);
+  else
+    editor_swap_flush(b, true);
+  close(sw->fd);
+  sw->fd = -1;
+  free(sw->path);
+  sw->path = NULL;
+  abuf_free(&sw->pending);
+  sw->pending.b = NULL;
+  sw->pending.len = 0;
+  free(sw->clips);
+  sw->clips = NULL;
+  sw->nclips = sw->clips_cap = 0;
+}
+
+void editor_swap_record(int type, int row, int at, const char *text, int len)
+{
+  struct swap_file *sw = &ed_cfg.buf->swap;
+  if (sw->fd == -1 || sw->suspended)
+    return;
+
+  struct swap_record rec = { 0 };
+  rec.type = type;
+  rec.row = row;
+  rec.at = at;
+  // only insertions (and reorderings) need their bytes to be replayed
+  rec.len = type == EDIT_DEL_ROW ? 0 : len;
+  abuf_append(&sw->pending, (char *)&rec, sizeof(rec));
+  if (type == EDIT_INSERT_TEXT || type == EDIT_INSERT_ROW || type == EDIT_PERMUTE)
+    abuf_append(&sw->pending, text, len);
+
+  if (sw->pending.len >= FEMTO_SWAP_BATCH)
+    editor_swap_flush(ed_cfg.buf, false);
+}
+
+// Each row's length (a uint32_t) and text
+void editor_swap_put_rows(struct buffer *b, struct erow *rows, int n)
+{
+  struct swap_file *sw = &b->swap;
+  for (int j = 0; j < n; j++) {
+    uint32_t size = rows[j].size;
+    abuf_append(&sw->pending, (char *)&size, sizeof(size));
+    abuf_append(&sw->pending, editor_row_text(&rows[j]), rows[j].size);
+    if (sw->pending.len >= FEMTO_SWAP_BATCH)
+      editor_swap_flush(b, false);
+  }
+}
+
+// Write out c's rows, unless the journal has them already
+void editor_swap_put_clip(struct buffer *b, struct clip *c)
+{
+  struct swap_file *sw = &b->swap;
+  for (int j = 0; j < sw->nclips; j++) {
+    if (sw->clips[j] == c->id)
+      return;
+  }
+
+  if (sw->nclips == sw->clips_cap) {
+    int cap = sw->clips_cap ? sw->clips_cap * 2 : 16;
+    uint32_t *clips = realloc(sw->clips, sizeof(uint32_t) * cap);
+    if (clips == NULL)
+      die("realloc");
+    sw->clips = clips;
+    sw->clips_cap = cap;
+  }
+  sw->clips[sw->nclips++] = c->id;
+
+  struct swap_record rec = { 0 };
+  rec.type = FEMTO_SWAP_CLIP;
+  rec.row = c->id;
+  rec.len = c->count;
+  abuf_append(&sw->pending, (char *)&rec, sizeof(rec));
+  editor_swap_put_rows(b, c->rows, c->count);
+}
+
+// Bulk edits are one record with len the number of rows. A deletion needs
+// nothing else. An insertion from a clip names the clip and the row it
+// starts at; any other insertion is followed by its rows, since unlike the
+// undo journal the swap file can't share them.
+void editor_swap_record_bulk(int type, int row, int count, struct clip *clip, int from)
+{
+  struct swap_file *sw = &ed_cfg.buf->swap;
+  if (sw->fd == -1 || sw->suspended)
+    return;
+
+  bool insert = type == EDIT_INSERT_ROWS;
+  if (insert && clip)
+    editor_swap_put_clip(ed_cfg.buf, clip);
+
+  struct swap_record rec = { 0 };
+  rec.type = type;
+  rec.row = row;
+  rec.len = count;
+  if (insert && clip) {
+    rec.at = from;
+    rec.clip = clip->id;
+  }
+  abuf_append(&sw->pending, (char *)&rec, sizeof(rec));
+
+  if (insert && clip == NULL)
+    editor_swap_put_rows(ed_cfg.buf, &ed_cfg.buf->rows[row], count);
+  if (sw->pending.len >= FEMTO_SWAP_BATCH)
+    editor_swap_flush(ed_cfg.buf, false);
+}
+
+// How many bytes the rows after an EDIT_INSERT_ROWS record take up, or 0
+// if they're cut short
+size_t editor_swap_rows_len(const char *p, size_t avail, int n)
+{
+  size_t off = 0;
+  for (int j = 0; j < n; j++) {
+    uint32_t size;
+    if (avail - off < sizeof(size))
+      return 0;
+    memcpy(&size, p + off, sizeof(size));
+    off += sizeof(size);
+    if (avail - off < size)
+      return 0;
+    off += size;
+  }
+
+  return off;
+}
+
+// A clip's rows as they are in the swap file being replayed
+struct swap_clip {
+  uint32_t id;
+  uint32_t count;
+  const char *rows;
+};
+
+// Apply the records in buf over the freshly loaded file. Stops at the first
+// record that is cut short or doesn't make sense, which is what a crash in
+// the middle of a write leaves behind. Returns how many bytes were good.
+size_t editor_swap_replay(const char *buf, size_t len)
+{
+  size_t off = 0;
+  int last_row = 0;
+  // a journal that was carried on after a recovery can use an id twice,
+  // the latest one counts
+  struct swap_clip *clips = NULL;
+  int nclips = 0;
+
+  while (off + sizeof(struct swap_record) <= len) {
+    struct swap_record rec;
+    memcpy(&rec, buf + off, sizeof(rec));
+    const char *text = buf + off + sizeof(rec);
+    size_t avail = len - off - sizeof(rec);
+    bool has_text = rec.type == EDIT_INSERT_TEXT || rec.type == EDIT_INSERT_ROW ||
+      rec.type == EDIT_PERMUTE;
+    if (has_text && rec.len > avail)
+      break;
+    size_t text_len = has_text ? rec.len : 0;
+    if ((rec.type == EDIT_INSERT_ROWS && rec.clip == 0) || rec.type == FEMTO_SWAP_CLIP ||
+        rec.type == FEMTO_SWAP_ALL) {
+      text_len = editor_swap_rows_len(text, avail, rec.len);
+      if (text_len == 0)
+        break;
+    }
+
+    // check the fields as they are, before they become ints
+    uint64_t numrows = ed_cfg.buf->numrows;
+    uint64_t size = rec.row < numrows ? (uint64_t)ed_cfg.buf->rows[rec.row].size : 0;
+    int row = rec.row;
+    int at = rec.at;
+    int n = rec.len;
+    bool ok = true;
+    switch (rec.type) {
+      case EDIT_INSERT_TEXT:
+        ok = rec.row < numrows && rec.at <= size && size + rec.len <= INT_MAX;
+        if (ok)
+          editor_row_insert_str(&ed_cfg.buf->rows[row], at, text, n);
+        break;
+      case EDIT_DEL_TEXT:
+        ok = rec.row < numrows && (uint64_t)rec.at + rec.len <= size;
+        if (ok)
+          editor_row_del_str(&ed_cfg.buf->rows[row], at, n);
+        break;
+      case EDIT_INSERT_ROW:
+        ok = rec.row <= numrows && numrows < INT_MAX && rec.len <= INT_MAX;
+        if (ok)
+          editor_insert_row(row, (char *)text, n);
+        break;
+      case EDIT_DEL_ROW:
+        ok = rec.row < numrows;
+        if (ok)
+          editor_del_row(row);
+        break;
+      case FEMTO_SWAP_CLIP: {
+        struct swap_clip *more = realloc(clips, sizeof(struct swap_clip) * (nclips + 1));
+        if (more == NULL)
+          die("realloc");
+        clips = more;
+        clips[nclips++] = (struct swap_clip){ rec.row, rec.len, text };
+        break;
+      }
+      case EDIT_INSERT_ROWS: {
+        const char *p = text;
+        if (rec.clip) {
+          int k = nclips - 1;
+          while (k >= 0 && clips[k].id != rec.clip)
+            k--;
+          ok = k >= 0 && (uint64_t)rec.at + rec.len <= clips[k].count;
+          if (!ok)
+            break;
+          // skip to row at of the clip
+          p = clips[k].rows;
+          for (uint32_t j = 0; j < rec.at; j++) {
+            uint32_t size;
+            memcpy(&size, p, sizeof(size));
+            p += sizeof(size) + size;
+          }
+        }
+        ok = rec.row <= numrows && numrows + rec.len <= INT_MAX;
+        if (ok)
+          editor_insert_rows_packed(row, n, p);
+        break;
+      }
+      case EDIT_PERMUTE: {
+        n = rec.len / sizeof(int);
+        ok = rec.len % sizeof(int) == 0 && (uint64_t)rec.row + n <= numrows;
+        int *perm = ok ? malloc(rec.len) : NULL;
+        if (perm) {
+          memcpy(perm, text, rec.len);
+          ok = editor_permutation_valid(perm, n);
+          if (ok)
+            editor_rows_permute(row, n, perm);
+        }
+        free(perm);
+        break;
+      }
+      case EDIT_DEL_ROWS:
+        ok = rec.len > 0 && (uint64_t)rec.row + rec.len <= numrows;
+        if (ok)
+          editor_del_rows(row, n);
+        break;
+      case FEMTO_SWAP_ALL:
+        ok = rec.len <= INT_MAX;
+        if (ok) {
+          editor_del_rows(0, ed_cfg.buf->numrows);
+          editor_insert_rows_packed(0, n, text);
+        }
+        break;
+      default:
+        ok = false;
+    }
+    if (!ok)
+      break;
+
+    if (rec.type != FEMTO_SWAP_CLIP)
+      last_row = row;
+    off += sizeof(rec) + text_len;
+  }
+  free(clips);
+
+  ed_cfg.buf->cy = last_row < ed_cfg.buf->numrows ? last_row : ed_cfg.buf->numrows;
+
+  return off;
+}
+
+// Open (or create) the swap file for b->filename. When recover is set
+// and there's a journal left over from a crash, offer to replay it.
+void editor_swap_open(struct buffer *b, bool recover)
+{
+  struct swap_file *sw = &b->swap;
+  if (b->filename == NULL || !ed_cfg.swap_enabled)
+    return;
+  // edits can only be replayed into the buffer on screen
+  sw->recover = recover && b != ed_cfg.buf;
+  if (sw->recover)
+    return;
+  editor_swap_close(b, false);
+
+  char *path = editor_swap_path(b->filename);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    editor_set_status_message("No swap file: %s", strerror(errno));
+    free(path);
+    return;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+    editor_set_status_message("%s is open in another femto, no swap file", 
+      b->filename);
+    close(fd);
+    free(path);
+    return;
+  }
+
+  sw->fd = fd;
+  sw->path = path;
+
+  struct stat st;
+  size_t good = sizeof(struct swap_header);
+  if (recover && fstat(fd, &st) == 0 && 
+      st.st_size > (off_t)sizeof(struct swap_header)) {
+    char *buf = malloc(st.st_size);
+    struct swap_header hdr, now;
+    editor_swap_fill_header(b, &now);
+    if (buf && pread(fd, buf, st.st_size, 0) == st.st_size) {
+      memcpy(&hdr, buf, sizeof(hdr));
+      bool matches = !memcmp(hdr.magic, now.magic, sizeof(hdr.magic)) &&
+        hdr.version == now.version && hdr.size == now.size &&
+        hdr.mtime_sec == now.mtime_sec && hdr.mtime_nsec == now.mtime_nsec;
+
+      if (!matches) {
+        // The file changed since the journal was written, so replaying it
+        // would garble things. Keep it out of the way rather than lose it.
+        char *old = malloc(strlen(path) + 2);
+        sprintf(old, "%s~", path);
+        rename(path, old);
+        free(old);
+        close(fd);
+        sw->fd = -1;
+        sw->path = NULL;
+        editor_set_status_message("Stale swap file moved to %s~", path);
+        free(path);
+        free(buf);
+        editor_swap_open(b, false);
+        return;
+      }
+      else if (editor_confirm("Recover unsaved changes from the swap file?")) {
+        sw->suspended++;
+        b->undo.suspended++;
+        good += editor_swap_replay(buf + sizeof(hdr), st.st_size - sizeof(hdr));
+        b->undo.suspended--;
+        sw->suspended--;
+        b->dirty = true;
+        editor_set_status_message("Recovered unsaved changes");
+      }
+      else {
+        good = 0;
+      }
+    }
+    free(buf);
+  }
+  else {
+    good = 0;
+  }
+
+  if (good == 0) {
+    editor_swap_reset(b);
+  }
+  else {
+    // chop off anything after the last complete record and keep appending
+    ftruncate(fd, good);
+    lseek(fd, good, SEEK_SET);
+    sw->last_sync = monotonic_ms();
+  }
+}
+
+// Start the journal of a buffer that doesn't match its file (one restored
+// from a session with unsaved edits) over, with one record holding all of
+// its rows, so that replaying it over the file gets back to the buffer
+void editor_swap_seed(struct buffer *b)
+{
+  struct swap_file *sw = &b->swap;
+  editor_swap_open(b, false);
+  if (sw->fd == -1)
+    return;
+
+  struct swap_record rec = { 0 };
+  rec.type = FEMTO_SWAP_ALL;
+  rec.len = b->numrows;
+  abuf_append(&sw->pending, (char *)&rec, sizeof(rec));
+  editor_swap_put_rows(b, b->rows, b->numrows);
+  editor_swap_flush(b, true);
+}
+
+// Called from the input loop whenever it's waiting on a key
+void editor_idle(void)
+{
+  bool loaded = false;
+  for (struct buffer *b = ed_cfg.buffers; b; b = b->next) {
+    struct swap_file *sw = &b->swap;
+    if (sw->fd != -1 && (sw->pending.len > 0 || sw->unsynced) &&
+        monotonic_ms() - sw->last_sync >= FEMTO_SWAP_SYNC_MS)
+      editor_swap_flush(b, true);
+    if (b->load && editor_stream_poll(b))
+      loaded = true;
+  }
+  if (editor_map_check())
+    loaded = true;
+
+  // keep the session image from falling far behind, in case we never get
+  // to quit cleanly
+  if (ed_cfg.session && ed_cfg.session_behind &&
+      monotonic_ms() - ed_cfg.session_written >= FEMTO_SESSION_SAVE_MS) {
+    if (editor_session_save(ed_cfg.session, false))
+      ed_cfg.session_behind = false;
+    else
+      editor_set_status_message("Session not saved: %s", strerror(errno));
+    ed_cfg.session_written = monotonic_ms();
+  }
+
+  if (loaded)
+    editor_refresh_screen();
+}
+
+// Every edit the row primitives make comes through here
+void editor_record_edit(int type, int row, int at, const char *text, int len)
+{
+  editor_undo_record(type, row, at, text, len);
+  editor_swap_record(type, row, at, text, len);
+  ed_cfg.session_behind = true;
+  editor_filter_note_edit(type, row, at, text, len);
+  editor_line_index_note_edit(row);
+}
+
+// Every bulk row edit comes through here: deletions before the rows go
+// (with clip holding them, when the undo journal wants it), insertions
+// once the rows are in place (with clip the one they came from, starting
+// at its row from, if there is one)
+void editor_record_bulk(int type, int row, int count, struct clip *clip, int from)
+{
+  editor_undo_record_bulk(type, row, count, type == EDIT_DEL_ROWS ? clip : NULL);
+  editor_swap_record_bulk(type, row, count, clip, from);
+  ed_cfg.session_behind = true;
+  editor_filter_note_bulk(type, row, count);
+  editor_line_index_note_edit(row);
+}
+
+// filter
+
+// A filter shows only the rows containing a pattern, without copying any
+// text: ed_cfg.buf->filter.rows is a sorted index of the row numbers in view.
+// While it's active, row_offset and the cursor movement work in view
+// positions and the drawing code maps them back to rows. The index is kept
+// in step with edits as they happen (rows that get edited or inserted while
+// filtering join the view so the cursor never ends up on a hidden row;
+// while it's switched off they're checked against the pattern instead), so
+// switching the filter off and back on again is instant. Building it for
+// a new pattern is split across threads.
+
+#define FEMTO_FILTER_MAX_THREADS 16
+#define FEMTO_FILTER_ROWS_PER_THREAD 65536
+
+int editor_view_rows(void)
+{
+  return ed_cfg.buf->filter.active ? ed_cfg.buf->filter.count : ed_cfg.buf->numrows;
+}
+
+// Row number shown at view position v of buffer b. Past the end of the
+// view is the empty line after the last row, as usual.
+int editor_buffer_view_to_row(struct buffer *b, int v)
+{
+  if (!b->filter.active)
+    return v;
+  if (v < 0)
+    return 0;
+
+  return v < b->filter.count ? b->filter.rows[v] : b->numrows;
+}
+
+int editor_view_to_row(int v)
+{
+  return editor_buffer_view_to_row(ed_cfg.buf, v);
+}
+
+// Index of the first entry in the filter at or after row
+int editor_filter_lower_bound(int row)
+{
+  int lo = 0;
+  int hi = ed_cfg.buf->filter.count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (ed_cfg.buf->filter.rows[mid] < row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+// View position of a row, or of the next row in view if it's hidden
+int editor_row_to_view(int row)
+{
+  if (!ed_cfg.buf->filter.active)
+    return row;
+  if (row >= ed_cfg.buf->numrows)
+    return ed_cfg.buf->filter.count;
+
+  return editor_filter_lower_bound(row);
+}
+
+// The visible rows before and after row, or -1 when there isn't one
+int editor_view_prev_row(int row)
+{
+  if (!ed_cfg.buf->filter.active)
+    return row > 0 ? row - 1 : -1;
+
+  int v = editor_filter_lower_bound(row);
+  return v > 0 ? ed_cfg.buf->filter.rows[v - 1] : -1;
+}
+
+int editor_view_next_row(int row)
+{
+  if (!ed_cfg.buf->filter.active)
+    return row < ed_cfg.buf->numrows - 1 ? row + 1 : -1;
+
+  int v = editor_filter_lower_bound(row);
+  if (v < ed_cfg.buf->filter.count && ed_cfg.buf->filter.rows[v] == row)
+    ++v;
+  return v < ed_cfg.buf->filter.count ? ed_cfg.buf->filter.rows[v] : -1;
+}
+
+void editor_filter_insert_at(int v, int row)
+{
+  struct line_filter *f = &ed_cfg.buf->filter;
+  if (f->count == f->cap) {
+    int cap = f->cap ? f->cap * 2 : 256;
+    int *rows = realloc(f->rows, sizeof(int) * cap);
+    if (rows == NULL)
+      return;
+    f->rows = rows;
+    f->cap = cap;
+  }
+
+  memmove(&f->rows[v + 1], &f->rows[v], sizeof(int) * (f->count - v));
+  f->rows[v] = row;
+  f->count++;
+}
+
+// Rows in view move with a reordering
+void editor_filter_note_permute(int row, const int *perm, int n)
+{
+  struct line_filter *f = &ed_cfg.buf->filter;
+  int v = editor_filter_lower_bound(row);
+  int w = editor_filter_lower_bound(row + n);
+  if (v == w)
+    return;
+
+  bool *shown = calloc(n, sizeof(bool));
+  if (shown == NULL)
+    return;
+  for (int j = v; j < w; j++)
+    shown[f->rows[j] - row] = true;
+  for (int j = 0; j < n; j++) {
+    if (shown[perm[j]])
+      f->rows[v++] = row + j;
+  }
+  free(shown);
+}
+
+bool editor_filter_matches(const char *text, size_t len)
+{
+  const char *pattern = ed_cfg.buf->filter.pattern;
+  return memmem(text, len, pattern, strlen(pattern)) != NULL;
+}
+
+// Whether row holds the pattern once a text edit at at is made to it. The
+// row is warm, the primitives thaw it before recording.
+bool editor_filter_edit_matches(int type, int row, int at, const char *text, int len)
+{
+  struct erow *r = &ed_cfg.buf->rows[row];
+  size_t size = type == EDIT_INSERT_TEXT ? (size_t)r->size + len : (size_t)r->size - len;
+  char *s = malloc(size ? size : 1);
+  if (s == NULL)
+    return true;
+
+  memcpy(s, r->chars, at);
+  if (type == EDIT_INSERT_TEXT) {
+    memcpy(&s[at], text, len);
+    memcpy(&s[at + len], &r->chars[at], r->size - at);
+  }
+  else {
+    memcpy(&s[at], &r->chars[at + len], r->size - at - len);
+  }
+  bool match = editor_filter_matches(s, size);
+  free(s);
+
+  return match;
+}
+
+// Keep the index in step with an edit that's about to happen to row
+void editor_filter_note_edit(int type, int row, int at, const char *text, int len)
+{
+  struct line_filter *f = &ed_cfg.buf->filter;
+  if (f->pattern == NULL)
+    return;
+  if (type == EDIT_PERMUTE) {
+    editor_filter_note_permute(row, (const int *)text, len / sizeof(int));
+    return;
+  }
+
+  int v = editor_filter_lower_bound(row);
+  bool shown = v < f->count && f->rows[v] == row;
+  switch (type) {
+    case EDIT_INSERT_ROW:
+      for (int j = v; j < f->count; j++)
+        f->rows[j]++;
+      if (f->active || editor_filter_matches(text, len))
+        editor_filter_insert_at(v, row);
+      break;
+    case EDIT_DEL_ROW:
+      if (shown) {
+        memmove(&f->rows[v], &f->rows[v + 1], sizeof(int) * (f->count - v - 1));
+        f->count--;
+      }
+      for (int j = v; j < f->count; j++)
+        f->rows[j]--;
+      break;
+    default:
+      if (f->active) {
+        if (!shown)
+          editor_filter_insert_at(v, row);
+      }
+      else if (editor_filter_edit_matches(type, row, at, text, len) != shown) {
+        if (shown) {
+          memmove(&f->rows[v], &f->rows[v + 1], sizeof(int) * (f->count - v - 1));
+          f->count--;
+        }
+        else {
+          editor_filter_insert_at(v, row);
+        }
+      }
+      break;
+  }
+}
+
+void editor_filter_note_bulk(int type, int row, int count)
+{
+  struct line_filter *f = &ed_cfg.buf->filter;
+  if (f->pattern == NULL)
+    return;
+
+  int v = editor_filter_lower_bound(row);
+  if (type == EDIT_DEL_ROWS) {
+    int w = editor_filter_lower_bound(row + count);
+    memmove(&f->rows[v], &f->rows[w], sizeof(int) * (f->count - w));
+    f->count -= w - v;
+    for (int j = v; j < f->count; j++)
+      f->rows[j] -= count;
+    return;
+  }
+
+  // while the filter is off only the new rows that match join it
+  int *match = NULL;
+  int n = count;
+  if (!f->active) {
+    match = malloc(sizeof(int) * count);
+    if (match == NULL)
+      return;
+    struct cold_reader rd = {0};
+    n = 0;
+    for (int j = row; j < row + count; j++) {
+      struct erow *r = &ed_cfg.buf->rows[j];
+      if (editor_filter_matches(editor_cold_read(&rd, r), r->size))
+        match[n++] = j;
+    }
+    editor_cold_reader_free(&rd);
+  }
+
+  if (f->count + n > f->cap) {
+    int cap = f->cap ? f->cap : 256;
+    while (cap < f->count + n)
+      cap *= 2;
+    int *rows = realloc(f->rows, sizeof(int) * cap);
+    if (rows == NULL) {
+      free(match);
+      return;
+    }
+    f->rows = rows;
+    f->cap = cap;
+  }
+  for (int j = v; j < f->count; j++)
+    f->rows[j] += count;
+  memmove(&f->rows[v + n], &f->rows[v], sizeof(int) * (f->count - v));
+  for (int j = 0; j < n; j++)
+    f->rows[v + j] = match ? match[j] : row + j;
+  f->count += n;
+  free(match);
+}
+
+struct filter_job {
+  int first;
+  int last;
+  const char *pattern;
+  size_t pattern_len;
+  int *rows;
+  int count;
+  int cap;
+  struct cold_reader reader;
+};
+
+void *editor_filter_worker(void *arg)
+{
+  struct filter_job *job = arg;
+
+  for (int j = job->first; j < job->last; j++) {
+    struct erow *row = &ed_cfg.buf->rows[j];
+    const char *text = editor_cold_read(&job->reader, row);
+    if (!memmem(text, row->size, job->pattern, job->pattern_len))
+      continue;
+
+    if (job->count == job->cap) {
+      int cap = job->cap ? job->cap * 2 : 256;
+      int *rows = realloc(job->rows, sizeof(int) * cap);
+      if (rows == NULL)
+        break;
+      job->rows = rows;
+      job->cap = cap;
+    }
+    job->rows[job->count++] = j;
+  }
+
+  editor_cold_reader_free(&job->reader);
+
+  return NULL;
+}
+
+void editor_filter_build(const char *pattern)
+{
+  struct line_filter *f = &ed_cfg.buf->filter;
+
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > FEMTO_FILTER_MAX_THREADS)
+    nthreads = FEMTO_FILTER_MAX_THREADS;
+  if (nthreads > ed_cfg.buf->numrows / FEMTO_FILTER_ROWS_PER_THREAD)
+    nthreads = ed_cfg.buf->numrows / FEMTO_FILTER_ROWS_PER_THREAD;
+  if (nthreads < 1)
+    nthreads = 1;
+
+  struct filter_job jobs[FEMTO_FILTER_MAX_THREADS];
+  pthread_t threads[FEMTO_FILTER_MAX_THREADS];
+  bool started[FEMTO_FILTER_MAX_THREADS];
+  memset(jobs, 0, sizeof(jobs));
+
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t].first = (long long)ed_cfg.buf->numrows * t / nthreads;
+    jobs[t].last = (long long)ed_cfg.buf->numrows * (t + 1) / nthreads;
+    jobs[t].pattern = pattern;
+    jobs[t].pattern_len = strlen(pattern);
+    // the first chunk runs on this thread
+    started[t] = t > 0 &&
+      pthread_create(&threads[t], NULL, editor_filter_worker, &jobs[t]) == 0;
+  }
+  editor_filter_worker(&jobs[0]);
+
+  int total = 0;
+  for (int t = 0; t < nthreads; t++) {
+    if (started[t])
+      pthread_join(threads[t], NULL);
+    else if (t > 0)
+      editor_filter_worker(&jobs[t]);
+    total += jobs[t].count;
+  }
+
+  free(f->rows);
+  f->rows = malloc(sizeof(int) * (total ? total : 1));
+  f->cap = total;
+  f->count = 0;
+  for (int t = 0; t < nthreads; t++) {
+    if (f->rows)
+      memcpy(&f->rows[f->count], jobs[t].rows, sizeof(int) * jobs[t].count);
+    f->count += jobs[t].count;
+    free(jobs[t].rows);
+  }
+  if (f->rows == NULL)
+    f->count = f->cap = 0;
+
+  free(f->pattern);
+  f->pattern = strdup(pattern);
+}
+
+void editor_filter_clear(struct buffer *b)
+{
+  struct line_filter *f = &b->filter;
+  free(f->rows);
+  free(f->pattern);
+  memset(f, 0, sizeof(*f));
+}
+
+// Put the cursor on a row that's in view
+void editor_filter_snap_cursor(void)
+{
+  if (!ed_cfg.buf->filter.active || ed_cfg.buf->cy >= ed_cfg.buf->numrows)
+    return;
+
+  int v = editor_row_to_view(ed_cfg.buf->cy);
+  if (v >= ed_cfg.buf->filter.count)
+    v = ed_cfg.buf->filter.count - 1;
+  ed_cfg.buf->cy = v >= 0 ? ed_cfg.buf->filter.rows[v] : ed_cfg.buf->numrows;
+  ed_cfg.buf->cx = ed_cfg.buf->margin_width;
+  ed_cfg.buf->row_offset = editor_view_rows();
+}
+
+// Switch between the filtered view and the whole file
+void editor_filter_toggle(void)
+{
+  if (ed_cfg.buf->filter.pattern == NULL) {
+    editor_set_status_message("No filter yet, Ctrl-T sets one");
+    return;
+  }
+
+  int vy = editor_row_to_view(ed_cfg.buf->cy);
+  ed_cfg.buf->filter.active = !ed_cfg.buf->filter.active;
+  // keep the cursor on the same screen line as far as possible
+  int screen_y = vy - ed_cfg.buf->row_offset;
+  editor_filter_snap_cursor();
+  ed_cfg.buf->row_offset = editor_row_to_view(ed_cfg.buf->cy) - screen_y;
+  if (ed_cfg.buf->row_offset > editor_view_rows() - ed_cfg.screenrows)
+    ed_cfg.buf->row_offset = editor_view_rows() - ed_cfg.screenrows;
+  if (ed_cfg.buf->row_offset < 0)
+    ed_cfg.buf->row_offset = 0;
+}
+
+void editor_filter(void)
+{
+  char *pattern = editor_prompt("Filter: %s (ESC to show all lines)", NULL);
+  if (pattern == NULL) {
+    editor_filter_clear(ed_cfg.buf);
+    return;
+  }
+
+  editor_filter_build(pattern);
+  ed_cfg.buf->filter.active = true;
+  editor_filter_snap_cursor();
+  editor_set_status_message("%d lines contain \"%s\" (Ctrl-E to toggle)", 
+    ed_cfg.buf->filter.count, pattern);
+  free(pattern);
+}
+
+// line index
+
+// Byte offsets of the start of each row, as if the file were saved, so a
+// goto by offset or percentage can bisect instead of summing row lengths.
+// Only a prefix of the rows is ever valid: it's extended on demand, and an
+// edit to a row pulls it back to that row, since nothing before it moved.
+
+void editor_line_index_note_edit(int row)
+{
+  if (row + 1 < ed_cfg.buf->lines.valid)
+    ed_cfg.buf->lines.valid = row + 1;
+}
+
+void editor_line_index_clear(struct buffer *b)
+{
+  free(b->lines.offsets);
+  memset(&b->lines, 0, sizeof(b->lines));
+}
+
+// Make the offsets of rows 0 through last valid
+void editor_line_index_extend(int last)
+{
+  struct line_index *li = &ed_cfg.buf->lines;
+  if (last >= ed_cfg.buf->numrows)
+    last = ed_cfg.buf->numrows - 1;
+  if (last < li->valid)
+    return;
+
+  if (last >= li->cap) {
+    int cap = ed_cfg.buf->rows_cap > last ? ed_cfg.buf->rows_cap : last + 1;
+    long long *offsets = realloc(li->offsets, sizeof(long long) * cap);
+    if (offsets == NULL)
+      die("realloc");
+    li->offsets = offsets;
+    li->cap = cap;
+  }
+
+  if (li->valid == 0) {
+    li->offsets[0] = 0;
+    li->valid = 1;
+  }
+  for (int j = li->valid; j <= last; j++)
+    li->offsets[j] = li->offsets[j - 1] + ed_cfg.buf->rows[j - 1].size + 1;
+  li->valid = last + 1;
+}
+
+long long editor_row_byte_offset(int row)
+{
+  if (row >= ed_cfg.buf->numrows)
+    return editor_file_bytes();
+
+  editor_line_index_extend(row);
+  return ed_cfg.buf->lines.offsets[row];
+}
+
+// Size of the file as it would be saved
+long long editor_file_bytes(void)
+{
+  if (ed_cfg.buf->numrows == 0)
+    return 0;
+
+  int last = ed_cfg.buf->numrows - 1;
+  return editor_row_byte_offset(last) + ed_cfg.buf->rows[last].size + 1;
+}
+
+// The row containing byte off
+int editor_byte_offset_to_row(long long off)
+{
+  struct line_index *li = &ed_cfg.buf->lines;
+  if (ed_cfg.buf->numrows == 0 || off <= 0)
+    return 0;
+
+  // only index as far as the offset we're after
+  editor_line_index_extend(0);
+  while (li->valid < ed_cfg.buf->numrows && li->offsets[li->valid - 1] <= off)
+    editor_line_index_extend(li->valid * 2);
+
+  int lo = 0;
+  int hi = li->valid;
+  while (hi - lo > 1) {
+    int mid = lo + (hi - lo) / 2;
+    if (li->offsets[mid] <= off)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+// Looking for the first row from some point on that can be judged (one
+// with a timestamp, say) goes FEMTO_PROBE_ROWS at a time, and after the
+// window [start, stop) comes up empty this says where the next one starts.
+// The windows get further apart, so a long run of rows that can't be judged
+// (a huge stack trace) costs a few windows rather than a look at every row,
+// at the price of missing anything that hides in the gaps between them.
+int editor_probe_skip(int start, int stop, int end, long long *step)
+{
+  long long next = start + *step;
+  *step *= 2;
+  if (next + FEMTO_PROBE_ROWS > end)
+    next = end - FEMTO_PROBE_ROWS > stop ? end - FEMTO_PROBE_ROWS : stop;
+
+  return next;
+}
+
+// Where row's text starts in the file it was mapped from, or -1 if it isn't
+// reading from m (or any mapping, when m is NULL) any more
+long long editor_row_map_offset(const struct erow *row, struct file_map **m)
+{
+  if (row->cold == NULL || row->cold->map == NULL || (*m && row->cold->map != *m))
+    return -1;
+
+  *m = row->cold->map;
+  return (row->cold->data - (*m)->base) + row->cold_off;
+}
+
+// The row pct percent of the way into the file. Rows mapped with -m know
+// their place in the file, so this bisects them against the mapping's
+// length; otherwise it goes by the number of rows, rather than summing
+// every row's length to find out how big the file is.
+int editor_percent_to_row(double pct)
+{
+  struct buffer *buf = ed_cfg.buf;
+  struct file_map *m = NULL;
+  for (int j = 0; j < buf->numrows && j < FEMTO_PROBE_ROWS && m == NULL; j++)
+    editor_row_map_offset(&buf->rows[j], &m);
+  if (m == NULL) {
+    int row = buf->numrows * (pct / 100);
+    return row < buf->numrows ? row : (buf->numrows > 0 ? buf->numrows - 1 : 0);
+  }
+
+  long long target = m->len * (pct / 100);
+  int lo = 0;
+  int hi = buf->numrows;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    // the first row from mid on that still reads from the mapping
+    long long off = -1;
+    long long step = FEMTO_PROBE_ROWS;
+    int r = mid;
+    while (r < hi && off == -1) {
+      int start = r;
+      int stop = hi - r > FEMTO_PROBE_ROWS ? r + FEMTO_PROBE_ROWS : hi;
+      for (; r < stop && off == -1; r++)
+        off = editor_row_map_offset(&buf->rows[r], &m);
+      if (off == -1)
+        r = editor_probe_skip(start, stop, hi, &step);
+    }
+
+    if (off != -1 && off <= target)
+      lo = r;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return 0;
+
+  // lo - 1 is the last mapped row before target, and the rows after it that
+  // have been drawn or edited can be counted off from there
+  int row = lo - 1;
+  long long off = editor_row_map_offset(&buf->rows[row], &m);
+  for (int j = 0; j < FEMTO_PROBE_ROWS && row + 1 < buf->numrows; j++) {
+    off += buf->rows[row].size + 1;
+    if (off > target)
+      break;
+    ++row;
+  }
+
+  return row;
+}
+
+// timestamps
+
+// Jumping to a time in a log bisects the rows by the timestamp near the
+// start of each line. The format is worked out from the first line that
+// has one, and rows without one (stack traces and the like) are treated as
+// part of the entry above them.
+
+#define FEMTO_TS_SCAN 64
+#define FEMTO_TS_DETECT_ROWS 1000
+
+enum ts_format {
+  TS_NONE = 0,
+  TS_ISO,    // 2024-05-01 14:03:22 or 2024-05-01T14:03:22
+  TS_CLF,    // 01/May/2024:14:03:22, as in apache access logs
+  TS_SYSLOG, // May  1 14:03:22
+  TS_TIME    // 14:03:22
+};
+
+struct timestamp {
+  int year;
+  int mon;
+  int day;
+  int hour;
+  int min;
+  int sec;
+};
+
+const char *ts_months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                            "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+bool ts_digits(const char *s, int n, int *out)
+{
+  int v = 0;
+  for (int j = 0; j < n; j++) {
+    if (!isdigit((unsigned char)s[j]))
+      return false;
+    v = v * 10 + (s[j] - '0');
+  }
+  *out = v;
+
+  return true;
+}
+
+bool ts_month(const char *s, int *out)
+{
+  for (int j = 0; j < 12; j++) {
+    if (strncasecmp(s, ts_months[j], 3) == 0) {
+      *out = j + 1;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool ts_time(const char *s, struct timestamp *t)
+{
+  return ts_digits(s, 2, &t->hour) && s[2] == ':' &&
+         ts_digits(s + 3, 2, &t->min) && s[5] == ':' &&
+         ts_digits(s + 6, 2, &t->sec);
+}
+
+// Try to read a timestamp of the given format at the start of s
+bool ts_parse_at(const char *s, size_t len, int fmt, struct timestamp *t)
+{
+  switch (fmt) {
+    case TS_ISO:
+      return len >= 19 && ts_digits(s, 4, &t->year) && s[4] == '-' &&
+             ts_digits(s + 5, 2, &t->mon) && s[7] == '-' &&
+             ts_digits(s + 8, 2, &t->day) && (s[10] == ' ' || s[10] == 'T') &&
+             ts_time(s + 11, t);
+    case TS_CLF:
+      return len >= 20 && ts_digits(s, 2, &t->day) && s[2] == '/' &&
+             ts_month(s + 3, &t->mon) && s[6] == '/' &&
+             ts_digits(s + 7, 4, &t->year) && s[11] == ':' &&
+             ts_time(s + 12, t);
+    case TS_SYSLOG:
+      if (len < 15 || !ts_month(s, &t->mon) || s[3] != ' ')
+        return false;
+      t->year = 0;
+      if (s[4] == ' ' ? !ts_digits(s + 5, 1, &t->day) : !ts_digits(s + 4, 2, &t->day))
+        return false;
+      return s[6] == ' ' && ts_time(s + 7, t);
+    case TS_TIME:
+      t->year = t->mon = t->day = 0;
+      return len >= 8 && ts_time(s, t);
+  }
+
+  return false;
+}
+
+// Look for a timestamp near the start of a line. With fmt TS_NONE, any
+// format will do; the one found is returned.
+int ts_find(const char *s, size_t len, int fmt, struct timestamp *t)
+{
+  size_t scan = len < FEMTO_TS_SCAN ? len : FEMTO_TS_SCAN;
+  for (size_t j = 0; j < scan; j++) {
+    // don't start in the middle of a number
+    if (j > 0 && isalnum((unsigned char)s[j - 1]))
+      continue;
+
+    if (fmt != TS_NONE) {
+      if (ts_parse_at(s + j, len - j, fmt, t))
+        return fmt;
+      continue;
+    }
+    for (int f = TS_ISO; f <= TS_TIME; f++) {
+      if (ts_parse_at(s + j, len - j, f, t))
+        return f;
+    }
+  }
+
+  return TS_NONE;
+}
+
+long long ts_key(const struct timestamp *t)
+{
+  return ((((t->year * 13LL + t->mon) * 32 + t->day) * 24 + t->hour) * 60 +
+          t->min) * 60 + t->sec;
+}
+
+// Parse what the user typed: a date, a time or both, in any of the formats
+// above. Whatever is left out is taken from base (the first line's date)
+// or, for the time, is midnight.
+bool ts_parse_query(const char *q, const struct timestamp *base, struct timestamp *out)
+{
+  struct timestamp t = *base;
+  t.hour = t.min = t.sec = 0;
+  while (*q == ' ')
+    ++q;
+
+  size_t len = strlen(q);
+  bool have_date = false;
+  if (len >= 10 && ts_digits(q, 4, &t.year) && q[4] == '-' &&
+      ts_digits(q + 5, 2, &t.mon) && q[7] == '-' && ts_digits(q + 8, 2, &t.day)) {
+    q += 10;
+    have_date = true;
+  }
+  else if (len >= 11 && ts_digits(q, 2, &t.day) && q[2] == '/' &&
+           ts_month(q + 3, &t.mon) && q[6] == '/' && ts_digits(q + 7, 4, &t.year)) {
+    q += 11;
+    have_date = true;
+  }
+  else if (len >= 5 && ts_month(q, &t.mon) && q[3] == ' ') {
+    q += 4;
+    while (*q == ' ')
+      ++q;
+    if (!isdigit((unsigned char)*q))
+      return false;
+    t.day = strtol(q, (char **)&q, 10);
+    have_date = true;
+  }
+  if (have_date && (*q == ' ' || *q == 'T' || *q == ':'))
+    ++q;
+
+  bool have_time = false;
+  if (ts_digits(q, 2, &t.hour) && q[2] == ':' && ts_digits(q + 3, 2, &t.min)) {
+    q += 5;
+    if (q[0] == ':' && ts_digits(q + 1, 2, &t.sec))
+      q += 3;
+    have_time = true;
+  }
+  while (*q == ' ')
+    ++q;
+
+  if (*q != '\0' || !(have_date || have_time))
+    return false;
+  *out = t;
+
+  return true;
+}
+
+// Work out the timestamp format from the first lines that have one
+int editor_ts_detect(struct timestamp *first)
+{
+  int limit = ed_cfg.buf->numrows < FEMTO_TS_DETECT_ROWS ? ed_cfg.buf->numrows : FEMTO_TS_DETECT_ROWS;
+  for (int j = 0; j < limit; j++) {
+    struct erow *row = &ed_cfg.buf->rows[j];
+    int fmt = ts_find(editor_row_text(row), row->size, TS_NONE, first);
+    if (fmt != TS_NONE)
+      return fmt;
+  }
+
+  return TS_NONE;
+}
+
+// The first row with a timestamp from r on, or end if there's none
+int editor_ts_next(int r, int end, int fmt, struct timestamp *t)
+{
+  long long step = FEMTO_PROBE_ROWS;
+  while (r < end) {
+    int stop = end - r > FEMTO_PROBE_ROWS ? r + FEMTO_PROBE_ROWS : end;
+    for (int j = r; j < stop; j++) {
+      struct erow *row = &ed_cfg.buf->rows[j];
+      if (ts_find(editor_row_text(row), row->size, fmt, t) != TS_NONE)
+        return j;
+    }
+    r = editor_probe_skip(r, stop, end, &step);
+  }
+
+  return end;
+}
+
+// First row whose timestamp is at or after key
+int editor_ts_bisect(int fmt, long long key)
+{
+  int lo = 0;
+  int hi = ed_cfg.buf->numrows;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    struct timestamp t;
+    int r = editor_ts_next(mid, hi, fmt, &t);
+    if (r < hi && ts_key(&t) < key)
+      lo = r + 1;
+    else
+      hi = mid;
+  }
+
+  // lo can land on a continuation line of the row before it
+  struct timestamp t;
+  return editor_ts_next(lo, ed_cfg.buf->numrows, fmt, &t);
+}
+
+// editor operations
+
+void editor_insert_char(int c)
+{
+  if (ed_cfg.buf->cy == ed_cfg.buf->numrows) {
+    editor_insert_row(ed_cfg.buf->numrows, "", 0);
+  }
+
+  int at = ed_cfg.buf->cx - ed_cfg.buf->margin_width;
+  editor_row_insert_char(&ed_cfg.buf->rows[ed_cfg.buf->cy], at, c);
+  ++ed_cfg.buf->cx;
+}
+
+// Like editor_insert_char, for the bytes of one multibyte character
+void editor_insert_text(const char *s, int len)
+{
+  if (ed_cfg.buf->cy == ed_cfg.buf->numrows) {
+    editor_insert_row(ed_cfg.buf->numrows, "", 0);
+  }
+
+  int at = ed_cfg.buf->cx - ed_cfg.buf->margin_width;
+  editor_row_insert_str(&ed_cfg.buf->rows[ed_cfg.buf->cy], at, s, len);
+  ed_cfg.buf->cx += len;
+}
+
+void editor_insert_newline(void)
+{
+  if (ed_cfg.buf->numrows == 0) {
+    editor_insert_row(0, "", 0);
+    ed_cfg.buf->cx = ed_cfg.buf->margin_width + 1;
+    return;
+  }
+  else if (ed_cfg.buf->cx <= ed_cfg.buf->margin_width) {
+    editor_insert_row(ed_cfg.buf->cy, "", 0);
+  }
+  else {
+    int pos_in_line = ed_cfg.buf->cx - ed_cfg.buf->margin_width;
+    struct erow *row = &ed_cfg.buf->rows[ed_cfg.buf->cy];
+    editor_row_thaw(row);
+    editor_insert_row(ed_cfg.buf->cy + 1, &row->chars[pos_in_line],
+      row->size -pos_in_line);
+    row = &ed_cfg.buf->rows[ed_cfg.buf->cy];
+    editor_row_del_str(row, pos_in_line, row->size - pos_in_line);
+  }
+
+  ++ed_cfg.buf->cy;
+  ed_cfg.buf->cx = ed_cfg.buf->margin_width;
+}
+
+void editor_del_char(void)
+{
+  if (ed_cfg.buf->cy == ed_cfg.buf->numrows)
+    return;
+  if (ed_cfg.buf->cx <= ed_cfg.buf->margin_width && ed_cfg.buf->cy == 0)
+    return;
+
+  struct erow *row = &ed_cfg.buf->rows[ed_cfg.buf->cy];
+  if (ed_cfg.buf->cx > ed_cfg.buf->margin_width) {
+    // remove the whole character before the cursor, not just its last byte
+    int end = ed_cfg.buf->cx - ed_cfg.buf->margin_width;
+    int at = editor_row_prev_cx(row, end);
+    for (int j = at; j < end; j++)
+      editor_row_del_char(row, at);
+    ed_cfg.buf->cx = at + ed_cfg.buf->margin_width;
+  }
+  else {
+    editor_row_thaw(row);
+    ed_cfg.buf->cx = ed_cfg.buf->rows[ed_cfg.buf->cy - 1].size + ed_cfg.buf->margin_width;
+    editor_row_append_str(&ed_cfg.buf->rows[ed_cfg.buf->cy - 1], row->chars, row->size);
+    editor_del_row(ed_cfg.buf->cy);
+    --ed_cfg.buf->cy;
+  }
+}
+
+// selection
+
+// Ctrl-B starts selecting text at the cursor and Ctrl-K whole lines; the
+// cursor is the other end. Cut and copy go through the yank register, which
+// shares the rows it holds (see clips), so cutting, copying and pasting a
+// range of lines costs time in proportion to the number of rows, not bytes.
+// A selection in a filtered view covers the hidden rows in between too.
+
+void editor_select_start(bool lines)
+{
+  struct selection *sel = &ed_cfg.buf->sel;
+  if (sel->active && sel->lines == lines) {
+    sel->active = false;
+    return;
+  }
+
+  if (!sel->active) {
+    sel->active = true;
+    sel->row = ed_cfg.buf->cy;
+    sel->col = ed_cfg.buf->cx - ed_cfg.buf->margin_width;
+  }
+  sel->lines = lines;
+  editor_set_status_message("Selecting %s: Ctrl-X = cut | Ctrl-C = copy | ESC = cancel",
+    lines ? "lines" : "text");
+}
+
+void editor_select_clear(void)
+{
+  ed_cfg.buf->sel.active = false;
+}
+
+// The selection, from (r1, c1) up to but not including (r2, c2). A line
+// selection runs to the end of its last row.
+bool editor_select_range(int *r1, int *c1, int *r2, int *c2)
+{
+  struct selection *sel = &ed_cfg.buf->sel;
+  int numrows = ed_cfg.buf->numrows;
+  if (!sel->active || numrows == 0)
+    return false;
+
+  int ar = sel->row, ac = sel->col;
+  int br = ed_cfg.buf->cy, bc = ed_cfg.buf->cx - ed_cfg.buf->margin_width;
+  // the line after the last row counts as the end of the last row
+  if (ar >= numrows) {
+    ar = numrows - 1;
+    ac = ed_cfg.buf->rows[ar].size;
+  }
+  if (br >= numrows) {
+    br = numrows - 1;
+    bc = ed_cfg.buf->rows[br].size;
+  }
+  if (ar > br || (ar == br && ac > bc)) {
+    int t = ar; ar = br; br = t;
+    t = ac; ac = bc; bc = t;
+  }
+
+  *r1 = ar;
+  *r2 = br;
+  *c1 = sel->lines ? 0 : ac;
+  *c2 = sel->lines ? ed_cfg.buf->rows[br].size : bc;
+  if (*c1 > ed_cfg.buf->rows[ar].size)
+    *c1 = ed_cfg.buf->rows[ar].size;
+  if (*c2 > ed_cfg.buf->rows[br].size)
+    *c2 = ed_cfg.buf->rows[br].size;
+
+  return true;
+}
+
+// Put the selection (or without one, the cursor's line) in the yank
+// register, and take it out of the buffer if cutting
+void editor_copy(bool cut)
+{
+  int r1, c1, r2, c2;
+  bool lines = ed_cfg.buf->sel.lines;
+  if (!editor_select_range(&r1, &c1, &r2, &c2)) {
+    if (ed_cfg.buf->cy >= ed_cfg.buf->numrows)
+      return;
+    r1 = r2 = ed_cfg.buf->cy;
+    c1 = 0;
+    c2 = ed_cfg.buf->rows[r2].size;
+    lines = true;
+  }
+  editor_select_clear();
+  if (!lines && r1 == r2 && c1 == c2)
+    return;
+
+  struct yank_register *y = &ed_cfg.yank;
+  editor_clip_unref(y->clip);
+  y->clip = editor_clip_take(r1, r2 + 1);
+  y->lines = lines;
+  y->head = c1;
+  y->tail = c2;
+
+  if (!cut) {
+    editor_set_status_message("Copied %d line%s", r2 - r1 + 1, r1 == r2 ? "" : "s");
+    return;
+  }
+
+  if (lines) {
+    editor_del_rows(r1, r2 - r1 + 1);
+    c1 = 0;
+  }
+  else if (r1 == r2) {
+    editor_row_del_str(&ed_cfg.buf->rows[r1], c1, c2 - c1);
+  }
+  else {
+    // join what's left of the first and last rows, and drop the rest
+    int len;
+    char *rest = editor_clip_text(y->clip, y->clip->count - 1, c2, INT_MAX, &len);
+    struct erow *first = &ed_cfg.buf->rows[r1];
+    editor_row_del_str(first, c1, first->size - c1);
+    editor_row_append_str(first, rest, len);
+    editor_del_rows(r1 + 1, r2 - r1);
+    free(rest);
+  }
+
+  ed_cfg.buf->cy = r1;
+  ed_cfg.buf->cx = c1 + ed_cfg.buf->margin_width;
+  editor_set_status_message("Cut %d line%s", r2 - r1 + 1, r1 == r2 ? "" : "s");
+}
+
+void editor_paste(void)
+{
+  struct yank_register *y = &ed_cfg.yank;
+  struct clip *c = y->clip;
+  if (c == NULL) {
+    editor_set_status_message("Nothing to paste");
+    return;
+  }
+  editor_select_clear();
+
+  // lines go in above the cursor's line, which ends up below them
+  int r = ed_cfg.buf->cy;
+  if (y->lines) {
+    editor_clip_put(c, 0, c->count, r);
+    ed_cfg.buf->cy = r + c->count;
+    ed_cfg.buf->cx = ed_cfg.buf->margin_width;
+    return;
+  }
+
+  if (r == ed_cfg.buf->numrows)
+    editor_insert_row(r, "", 0);
+  struct erow *row = &ed_cfg.buf->rows[r];
+  editor_row_thaw(row);
+  int at = ed_cfg.buf->cx - ed_cfg.buf->margin_width;
+  if (at > row->size)
+    at = row->size;
+
+  int len;
+  char *text = editor_clip_text(c, 0, y->head, c->count == 1 ? y->tail : INT_MAX, &len);
+  if (c->count == 1) {
+    editor_row_insert_str(row, at, text, len);
+    ed_cfg.buf->cx = at + len + ed_cfg.buf->margin_width;
+    free(text);
+    return;
+  }
+
+  // split the row at the cursor, the middle rows go in between as they are
+  int rest_len = row->size - at;
+  char *rest = malloc(rest_len + 1);
+  if (rest == NULL)
+    die("malloc");
+  memcpy(rest, &row->chars[at], rest_len);
+  editor_row_del_str(row, at, rest_len);
+  editor_row_append_str(&ed_cfg.buf->rows[r], text, len);
+  free(text);
+
+  editor_clip_put(c, 1, c->count - 1, r + 1);
+
+  int last = r + c->count - 1;
+  text = editor_clip_text(c, c->count - 1, 0, y->tail, &len);
+  editor_insert_row(last, text, len);
+  editor_row_append_str(&ed_cfg.buf->rows[last], rest, rest_len);
+  free(text);
+  free(rest);
+
+  ed_cfg.buf->cy = last;
+  ed_cfg.buf->cx = len + ed_cfg.buf->margin_width;
+}
+
+// sorting
+
+// Ctrl-R sorts, deduplicates or reverses the lines the selection touches,
+// or the whole buffer without one. Only the row structs get reordered (one
+// EDIT_PERMUTE), the text stays where it is. Lines compare byte by byte
+// like LC_ALL=C sort and equal ones keep their order, so uniq keeps the
+// first of each. The keys are merge sorted across threads; when the lines
+// add up to more than we want to hold at once (the -m budget, or a quarter
+// of the RAM) they're sorted in runs that go out to temporary files and get
+// merged back in.
+
+#define FEMTO_SORT_MAX_THREADS 16
+#define FEMTO_SORT_ROWS_PER_THREAD 65536
+
+enum sort_mode {
+  SORT_ASCENDING,
+  SORT_DESCENDING,
+  SORT_UNIQUE,
+  SORT_REVERSE
+};
+
+struct sort_key {
+  const char *text;
+  int size;
+  int row;
+};
+
+struct sort_job {
+  struct sort_key *keys;
+  struct sort_key *tmp;
+  size_t n;
+  size_t half; // merge the two sorted halves, or sort the lot if 0
+  bool desc;
+};
+
+// Decompressed copies of the blocks one run of keys points into
+struct sort_blocks {
+  struct cold_block **blocks;
+  char **raw;
+  int count;
+};
+
+// A sorted run in a temporary file, and the record at its head
+struct sort_run {
+  FILE *fp;
+  struct sort_key key;
+  char *buf;
+  size_t cap;
+};
+
+int sort_key_cmp(const struct sort_key *a, const struct sort_key *b, bool desc)
+{
+  int n = a->size < b->size ? a->size : b->size;
+  int c = n > 0 ? memcmp(a->text, b->text, n) : 0;
+  if (c == 0)
+    c = (a->size > b->size) - (a->size < b->size);
+  if (desc)
+    c = -c;
+
+  return c ? c : (a->row > b->row) - (a->row < b->row);
+}
+
+bool sort_key_equal(const struct sort_key *a, const struct sort_key *b)
+{
+  return a->size == b->size && (a->size == 0 || !memcmp(a->text, b->text, a->size));
+}
+
+void sort_merge(const struct sort_key *a, size_t na, const struct sort_key *b,
+  size_t nb, struct sort_key *out, bool desc)
+{
+  size_t i = 0, j = 0, k = 0;
+  while (i < na && j < nb)
+    out[k++] = sort_key_cmp(&b[j], &a[i], desc) < 0 ? b[j++] : a[i++];
+  while (i < na)
+    out[k++] = a[i++];
+  while (j < nb)
+    out[k++] = b[j++];
+}
+
+// Merge sort keys using tmp, which is as long
+void sort_keys(struct sort_key *keys, struct sort_key *tmp, size_t n, bool desc)
+{
+  if (n <= 16) {
+    for (size_t i = 1; i < n; i++) {
+      struct sort_key k = keys[i];
+      size_t j = i;
+      for (; j > 0 && sort_key_cmp(&k, &keys[j - 1], desc) < 0; j--)
+        keys[j] = keys[j - 1];
+      keys[j] = k;
+    }
+    return;
+  }
+
+  size_t half = n / 2;
+  sort_keys(keys, tmp, half, desc);
+  sort_keys(keys + half, tmp + half, n - half, desc);
+  if (sort_key_cmp(&keys[half - 1], &keys[half], desc) <= 0)
+    return;
+  sort_merge(keys, half, keys + half, n - half, tmp, desc);
+  memcpy(keys, tmp, sizeof(struct sort_key) * n);
+}
+
+void *editor_sort_worker(void *arg)
+{
+  struct sort_job *job = arg;
+
+  if (job->half == 0) {
+    sort_keys(job->keys, job->tmp, job->n, job->desc);
+    return NULL;
+  }
+
+  sort_merge(job->keys, job->half, job->keys + job->half, job->n - job->half,
+    job->tmp, job->desc);
+  memcpy(job->keys, job->tmp, sizeof(struct sort_key) * job->n);
+
+  return NULL;
+}
+
+void editor_sort_run_jobs(struct sort_job *jobs, int njobs)
+{
+  pthread_t threads[FEMTO_SORT_MAX_THREADS];
+  bool started[FEMTO_SORT_MAX_THREADS];
+
+  // the first job runs on this thread
+  for (int t = 1; t < njobs; t++)
+    started[t] = pthread_create(&threads[t], NULL, editor_sort_worker, &jobs[t]) == 0;
+  editor_sort_worker(&jobs[0]);
+
+  for (int t = 1; t < njobs; t++) {
+    if (started[t])
+      pthread_join(threads[t], NULL);
+    else
+      editor_sort_worker(&jobs[t]);
+  }
+}
+
+// Sort n keys: each thread sorts a slice, then neighbouring slices are
+// merged pairwise, with half as many threads every round
+bool editor_sort_keys(struct sort_key *keys, size_t n, bool desc)
+{
+  struct sort_key *tmp = malloc(sizeof(struct sort_key) * (n ? n : 1));
+  if (tmp == NULL)
+    return false;
+
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > FEMTO_SORT_MAX_THREADS)
+    nthreads = FEMTO_SORT_MAX_THREADS;
+  if ((size_t)nthreads > n / FEMTO_SORT_ROWS_PER_THREAD)
+    nthreads = n / FEMTO_SORT_ROWS_PER_THREAD;
+  if (nthreads < 1)
+    nthreads = 1;
+
+  size_t bounds[FEMTO_SORT_MAX_THREADS + 1];
+  for (int t = 0; t <= nthreads; t++)
+    bounds[t] = n * t / nthreads;
+
+  struct sort_job jobs[FEMTO_SORT_MAX_THREADS];
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t] = (struct sort_job){ keys + bounds[t], tmp + bounds[t],
+      bounds[t + 1] - bounds[t], 0, desc };
+  }
+  editor_sort_run_jobs(jobs, nthreads);
+
+  for (int width = 1; width < nthreads; width *= 2) {
+    int njobs = 0;
+    for (int t = 0; t + width < nthreads; t += 2 * width) {
+      int end = t + 2 * width < nthreads ? t + 2 * width : nthreads;
+      jobs[njobs++] = (struct sort_job){ keys + bounds[t], tmp + bounds[t],
+        bounds[end] - bounds[t], bounds[t + width] - bounds[t], desc };
+    }
+    editor_sort_run_jobs(jobs, njobs);
+  }
+  free(tmp);
+
+  return true;
+}
+
+int sort_block_cmp(const void *a, const void *b)
+{
+  uintptr_t x = (uintptr_t)*(struct cold_block *const *)a;
+  uintptr_t y = (uintptr_t)*(struct cold_block *const *)b;
+
+  return (x > y) - (x < y);
+}
+
+void editor_sort_blocks_free(struct sort_blocks *sb)
+{
+  // raw is NULL if allocating it failed after the blocks were counted
+  if (sb->raw) {
+    for (int j = 0; j < sb->count; j++)
+      free(sb->raw[j]);
+  }
+  free(sb->blocks);
+  free(sb->raw);
+  memset(sb, 0, sizeof(*sb));
+}
+
+// Fill in keys for rows first to last. Rows in compressed blocks that aren't
+// in the cache get a copy of their block decompressed just for us, once.
+bool editor_sort_fill_keys(struct sort_key *keys, int first, int last,
+  struct sort_blocks *sb)
+{
+  int n = 0;
+  sb->blocks = malloc(sizeof(struct cold_block *) * (last - first));
+  if (sb->blocks == NULL)
+    return false;
+  for (int j = first; j < last; j++) {
+    struct cold_block *b = ed_cfg.buf->rows[j].cold;
+    if (b && b->compressed && b->raw == NULL && (n == 0 || sb->blocks[n - 1] != b))
+      sb->blocks[n++] = b;
+  }
+  qsort(sb->blocks, n, sizeof(struct cold_block *), sort_block_cmp);
+  for (int j = 0; j < n; j++) {
+    if (sb->count == 0 || sb->blocks[sb->count - 1] != sb->blocks[j])
+      sb->blocks[sb->count++] = sb->blocks[j];
+  }
+
+  sb->raw = calloc(sb->count ? sb->count : 1, sizeof(char *));
+  if (sb->raw == NULL)
+    return false;
+  for (int j = 0; j < sb->count; j++) {
+    struct cold_block *b = sb->blocks[j];
+    sb->raw[j] = malloc(b->rawlen ? b->rawlen : 1);
+    if (sb->raw[j] == NULL || lz_decompress(b->data, b->clen, sb->raw[j], b->rawlen) == -1)
+      return false;
+  }
+
+  for (int j = first; j < last; j++) {
+    struct erow *row = &ed_cfg.buf->rows[j];
+    struct cold_block *b = row->cold;
+    keys[j - first].size = row->size;
+    keys[j - first].row = j;
+    if (b == NULL) {
+      keys[j - first].text = row->chars;
+    }
+    else if (b->raw || !b->compressed) {
+      keys[j - first].text = (b->raw ? b->raw : b->data) + row->cold_off;
+    }
+    else {
+      struct cold_block **found = bsearch(&b, sb->blocks, sb->count,
+        sizeof(struct cold_block *), sort_block_cmp);
+      keys[j - first].text = sb->raw[found - sb->blocks] + row->cold_off;
+    }
+  }
+
+  return true;
+}
+
+// How many bytes of lines to sort in memory at once
+size_t editor_sort_budget(void)
+{
+  if (ed_cfg.cold.enabled)
+    return ed_cfg.cold.budget;
+
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || page_size <= 0)
+    return SIZE_MAX;
+
+  return (size_t)pages * page_size / 4;
+}
+
+bool editor_sort_run_next(struct sort_run *run)
+{
+  int32_t head[2];
+  if (fread(head, sizeof(head), 1, run->fp) != 1)
+    return false;
+
+  size_t size = head[1];
+  if (run->cap < size) {
+    char *buf = realloc(run->buf, size);
+    if (buf == NULL)
+      return false;
+    run->buf = buf;
+    run->cap = size;
+  }
+  if (size > 0 && fread(run->buf, size, 1, run->fp) != 1)
+    return false;
+  run->key = (struct sort_key){ run->buf, head[1], head[0] };
+
+  return true;
+}
+
+void sort_heap_down(struct sort_run **heap, int n, int at, bool desc)
+{
+  while (1) {
+    int min = at;
+    for (int c = 2 * at + 1; c <= 2 * at + 2 && c < n; c++) {
+      if (sort_key_cmp(&heap[c]->key, &heap[min]->key, desc) < 0)
+        min = c;
+    }
+    if (min == at)
+      return;
+    struct sort_run *t = heap[at];
+    heap[at] = heap[min];
+    heap[min] = t;
+    at = min;
+  }
+}
+
+// Sort the rows in memory-sized runs written out to temporary files, then
+// merge them into perm
+bool editor_sort_external(int first, int n, bool desc, size_t budget, int *perm,
+  unsigned char *dups)
+{
+  struct sort_run *runs = NULL;
+  int nruns = 0;
+  bool ok = true;
+
+  for (int lo = first; lo < first + n && ok; ) {
+    int hi = lo;
+    size_t bytes = 0;
+    while (hi < first + n && (hi == lo || bytes < budget)) {
+      bytes += ed_cfg.buf->rows[hi].size + sizeof(struct sort_key);
+      hi++;
+    }
+
+    struct sort_run *grown = realloc(runs, sizeof(struct sort_run) * (nruns + 1));
+    struct sort_key *keys = malloc(sizeof(struct sort_key) * (hi - lo));
+    struct sort_blocks sb = {0};
+    FILE *fp = tmpfile();
+    if (grown)
+      runs = grown;
+    ok = grown && keys && fp && editor_sort_fill_keys(keys, lo, hi, &sb) &&
+      editor_sort_keys(keys, hi - lo, desc);
+    for (int j = 0; j < hi - lo && ok; j++) {
+      int32_t head[2] = { keys[j].row, keys[j].size };
+      ok = fwrite(head, sizeof(head), 1, fp) == 1 &&
+        (keys[j].size == 0 || fwrite(keys[j].text, keys[j].size, 1, fp) == 1);
+    }
+    ok = ok && fflush(fp) == 0;
+    editor_sort_blocks_free(&sb);
+    free(keys);
+
+    if (grown && fp) {
+      memset(&runs[nruns], 0, sizeof(struct sort_run));
+      runs[nruns++].fp = fp;
+    }
+    else if (fp) {
+      fclose(fp);
+    }
+    lo = hi;
+  }
+
+  struct sort_run **heap = malloc(sizeof(struct sort_run *) * (nruns ? nruns : 1));
+  int nheap = 0;
+  ok = ok && heap;
+  for (int r = 0; r < nruns && ok; r++) {
+    rewind(runs[r].fp);
+    if (editor_sort_run_next(&runs[r]))
+      heap[nheap++] = &runs[r];
+  }
+  for (int j = nheap / 2 - 1; j >= 0 && ok; j--)
+    sort_heap_down(heap, nheap, j, desc);
+
+  char *prev = NULL;
+  int prev_size = -1;
+  int count = 0;
+  while (ok && nheap > 0 && count < n) {
+    struct sort_run *run = heap[0];
+    struct sort_key *k = &run->key;
+    perm[count++] = k->row - first;
+    if (dups && prev_size == k->size && (k->size == 0 || !memcmp(prev, k->text, k->size)))
+      dups[k->row - first] = 1;
+    else if (dups) {
+      char *p = realloc(prev, k->size ? k->size : 1);
+      ok = p != NULL;
+      prev = p ? p : prev;
+      if (ok)
+        memcpy(prev, k->text, k->size);
+      prev_size = k->size;
+    }
+
+    if (!editor_sort_run_next(run))
+      heap[0] = heap[--nheap];
+    sort_heap_down(heap, nheap, 0, desc);
+  }
+  ok = ok && count == n;
+
+  free(prev);
+  free(heap);
+  for (int r = 0; r < nruns; r++) {
+    fclose(runs[r].fp);
+    free(runs[r].buf);
+  }
+  free(runs);
+
+  return ok;
+}
+
+// The order the n rows from first should go in, or NULL if we ran out of
+// memory. With dups, rows that repeat an earlier one get flagged in it.
+int *editor_sort_rows(int first, int n, bool desc, unsigned char *dups)
+{
+  int *perm = malloc(sizeof(int) * n);
+  if (perm == NULL)
+    return NULL;
+
+  size_t budget = editor_sort_budget();
+  size_t bytes = 0;
+  for (int j = first; j < first + n; j++)
+    bytes += ed_cfg.buf->rows[j].size + sizeof(struct sort_key);
+  if (bytes > budget) {
+    if (editor_sort_external(first, n, desc, budget, perm, dups))
+      return perm;
+    free(perm);
+    return NULL;
+  }
+
+  struct sort_key *keys = malloc(sizeof(struct sort_key) * n);
+  struct sort_blocks sb = {0};
+  bool ok = keys && editor_sort_fill_keys(keys, first, first + n, &sb) &&
+    editor_sort_keys(keys, n, desc);
+  for (int j = 0; j < n && ok; j++) {
+    perm[j] = keys[j].row - first;
+    if (dups && j > 0 && sort_key_equal(&keys[j], &keys[j - 1]))
+      dups[keys[j].row - first] = 1;
+  }
+  editor_sort_blocks_free(&sb);
+  free(keys);
+  if (!ok) {
+    free(perm);
+    return NULL;
+  }
+
+  return perm;
+}
+
+// Drop the rows that repeat an earlier one: they're moved to the end of the
+// range, keeping the order of the rest, and deleted from there
+int editor_sort_unique(int first, int n)
+{
+  unsigned char *dups = calloc(n, 1);
+  int *perm = dups ? editor_sort_rows(first, n, false, dups) : NULL;
+  if (perm == NULL) {
+    free(dups);
+    return -1;
+  }
+
+  int from = 0;
+  while (from < n && !dups[from])
+    from++;
+  int kept = from;
+  for (int j = from; j < n; j++) {
+    if (!dups[j])
+      perm[kept++ - from] = j - from;
+  }
+  int removed = n - kept;
+  for (int j = from, k = kept - from; j < n; j++) {
+    if (dups[j])
+      perm[k++] = j - from;
+  }
+
+  if (removed > 0) {
+    editor_rows_permute(first + from, n - from, perm);
+    editor_del_rows(first + kept, removed);
+  }
+  free(perm);
+  free(dups);
+
+  return removed;
+}
+
+void editor_sort_lines(void)
+{
+  char *cmd = editor_prompt("Lines: sort, rsort, uniq or reverse? %s", NULL);
+  if (cmd == NULL)
+    return;
+
+  int mode = -1;
+  const char *names[] = { "sort", "rsort", "uniq", "reverse" };
+  for (int j = 0; j < 4; j++) {
+    if (!strcmp(cmd, names[j]))
+      mode = j;
+  }
+  free(cmd);
+  if (mode == -1) {
+    editor_set_status_message("Unknown command");
+    return;
+  }
+
+  int first = 0, last = ed_cfg.buf->numrows - 1;
+  int c1, c2;
+  editor_select_range(&first, &c1, &last, &c2);
+  editor_select_clear();
+  int n = last - first + 1;
+  if (n < 2) {
+    editor_set_status_message("Nothing to %s", names[mode]);
+    return;
+  }
+
+  // the permutation goes in the undo journal, 4 bytes a line (uniq's keeps
+  // the lines it leaves, so n of them is as big as it gets)
+  if (!editor_undo_fits(sizeof(int) * (size_t)n)) {
+    char question[96];
+    snprintf(question, sizeof(question), "Undo can't hold a %s of %d lines "
+      "and gets cleared. Go ahead?", names[mode], n);
+    if (!editor_confirm(question))
+      return;
+  }
+
+  int *perm = NULL;
+  switch (mode) {
+    case SORT_ASCENDING:
+    case SORT_DESCENDING:
+      perm = editor_sort_rows(first, n, mode == SORT_DESCENDING, NULL);
+      break;
+    case SORT_REVERSE:
+      perm = malloc(sizeof(int) * n);
+      for (int j = 0; perm && j < n; j++)
+        perm[j] = n - 1 - j;
+      break;
+    case SORT_UNIQUE: {
+      int removed = editor_sort_unique(first, n);
+      if (removed == -1)
+        break;
+      ed_cfg.buf->cy = first;
+      ed_cfg.buf->cx = ed_cfg.buf->margin_width;
+      editor_filter_snap_cursor();
+      editor_set_status_message("Removed %d duplicate line%s", removed,
+        removed == 1 ? "" : "s");
+      return;
+    }
+  }
+  if (perm == NULL) {
+    editor_set_status_message("Not enough memory to %s %d lines", names[mode], n);
+    return;
+  }
+
+  editor_rows_permute(first, n, perm);
+  free(perm);
+  ed_cfg.buf->cy = first;
+  ed_cfg.buf->cx = ed_cfg.buf->margin_width;
+  editor_filter_snap_cursor();
+  editor_set_status_message("%s %d lines", mode == SORT_REVERSE ? "Reversed" : "Sorted", n);
+}
+
+// compressed files
+
+// .gz and .zst files are decompressed as they're read and compressed as
+// they're written, with no uncompressed copy on disk. Reading runs on a
+// worker thread that hands whole lines over to the main thread, which adds
+// them to the buffer while it waits for keys. So the start of a big log can
+// be read while the rest is still coming in, with the buffer read only
+// until it's all there. Writing fills one chunk while a worker compresses
+// the one before. zlib is linked in, but libzstd is only loaded when a
+// .zst file comes along, so femto still runs on machines without it.
+
+#define FEMTO_STREAM_READ (256 * 1024)
+#define FEMTO_STREAM_QUEUE (8 * 1024 * 1024)
+#define FEMTO_STREAM_SLICE_MS 50
+#define FEMTO_WRITE_CHUNK (1024 * 1024)
+
+enum file_format {
+  FORMAT_PLAIN,
+  FORMAT_GZIP,
+  FORMAT_ZSTD
+};
+
+// The bits of the zstd streaming API we use, as in zstd.h
+struct zstd_in {
+  const void *src;
+  size_t size;
+  size_t pos;
+};
+
+struct zstd_out {
+  void *dst;
+  size_t size;
+  size_t pos;
+};
+
+struct zstd_api {
+  bool tried;
+  void *handle;
+  void *(*create_dstream)(void);
+  size_t (*free_dstream)(void *);
+  size_t (*init_dstream)(void *);
+  size_t (*decompress_stream)(void *, struct zstd_out *, struct zstd_in *);
+  void *(*create_cstream)(void);
+  size_t (*free_cstream)(void *);
+  size_t (*init_cstream)(void *, int);
+  size_t (*compress_stream)(void *, struct zstd_out *, struct zstd_in *);
+  size_t (*end_stream)(void *, struct zstd_out *);
+  unsigned (*is_error)(size_t);
+};
+
+struct zstd_api zstd;
+
+// A growable byte buffer, like abuf but without a realloc per append
+struct stream_buf {
+  char *b;
+  size_t len;
+  size_t cap;
+};
+
+struct stream_load {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int fd;
+  int format;
+  struct stream_buf lines; // whole lines, ready to be added
+  bool done;
+  bool cancel;
+  int err; // an errno, or -1 for data that's corrupt or cut short
+};
+
+struct file_writer {
+  int fd;
+  int format;
+  char *chunk; // being filled
+  size_t used;
+  long long written;
+  int err;
+  // for compressed formats, the worker and the chunk it's working on
+  pthread_t thread;
+  bool started;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char *full;
+  size_t full_len;
+  char *spare;
+  bool closing;
+  z_stream z;
+  void *zc;
+  char *out;
+};
+
+bool editor_zstd_load(void)
+{
+  if (zstd.tried)
+    return zstd.handle != NULL;
+  zstd.tried = true;
+
+  void *handle = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL)
+    return false;
+
+  struct {
+    void **fn;
+    const char *name;
+  } syms[] = {
+    { (void **)&zstd.create_dstream, "ZSTD_createDStream" },
+    { (void **)&zstd.free_dstream, "ZSTD_freeDStream" },
+    { (void **)&zstd.init_dstream, "ZSTD_initDStream" },
+    { (void **)&zstd.decompress_stream, "ZSTD_decompressStream" },
+    { (void **)&zstd.create_cstream, "ZSTD_createCStream" },
+    { (void **)&zstd.free_cstream, "ZSTD_freeCStream" },
+    { (void **)&zstd.init_cstream, "ZSTD_initCStream" },
+    { (void **)&zstd.compress_stream, "ZSTD_compressStream" },
+    { (void **)&zstd.end_stream, "ZSTD_endStream" },
+    { (void **)&zstd.is_error, "ZSTD_isError" },
+  };
+  for (size_t j = 0; j < sizeof(syms) / sizeof(syms[0]); j++) {
+    *syms[j].fn = dlsym(handle, syms[j].name);
+    if (*syms[j].fn == NULL) {
+      dlclose(handle);
+      return false;
+    }
+  }
+  zstd.handle = handle;
+
+  return true;
+}
+
+// Which format the file is in, going by its first bytes
+int editor_detect_format(int fd)
+{
+  unsigned char magic[4];
+  if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+    return FORMAT_PLAIN;
+  if (magic[0] == 0x1f && magic[1] == 0x8b)
+    return FORMAT_GZIP;
+  if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+    return FORMAT_ZSTD;
+
+  return FORMAT_PLAIN;
+}
+
+// Which format to write filename in: what its name says, or else what it
+// was when we read it
+int editor_save_format(const char *filename)
+{
+  const char *dot = strrchr(filename, '.');
+  if (dot && !strcmp(dot, ".gz"))
+    return FORMAT_GZIP;
+  if (dot && !strcmp(dot, ".zst"))
+    return FORMAT_ZSTD;
+
+  return ed_cfg.buf->format;
+}
+
+bool stream_buf_append(struct stream_buf *sb, const char *s, size_t len)
+{
+  if (len == 0)
+    return true;
+  if (sb->len + len > sb->cap) {
+    size_t cap = sb->cap ? sb->cap : 4096;
+    while (cap < sb->len + len)
+      cap *= 2;
+    char *b = realloc(sb->b, cap);
+    if (b == NULL)
+      return false;
+    sb->b = b;
+    sb->cap = cap;
+  }
+  memcpy(&sb->b[sb->len], s, len);
+  sb->len += len;
+
+  return true;
+}
+
+// Hand over the whole lines in carry plus len bytes at s, keeping the
+// partial line at the end back in carry. Blocks while the main thread is
+// behind.
+bool editor_stream_produce(struct stream_load *ld, struct stream_buf *carry,
+  const char *s, size_t len)
+{
+  const char *nl = memrchr(s, '\n', len);
+  if (nl == NULL)
+    return stream_buf_append(carry, s, len);
+
+  size_t whole = nl - s + 1;
+  pthread_mutex_lock(&ld->lock);
+  while (ld->lines.len >= FEMTO_STREAM_QUEUE && !ld->cancel)
+    pthread_cond_wait(&ld->cond, &ld->lock);
+  bool ok = stream_buf_append(&ld->lines, carry->b, carry->len) &&
+    stream_buf_append(&ld->lines, s, whole);
+  pthread_mutex_unlock(&ld->lock);
+
+  carry->len = 0;
+  return ok && stream_buf_append(carry, nl + 1, len - whole);
+}
+
+void *editor_stream_worker(void *arg)
+{
+  struct stream_load *ld = arg;
+  struct stream_buf carry = {0};
+  size_t out_cap = FEMTO_STREAM_READ * 4;
+  char *in = malloc(FEMTO_STREAM_READ);
+  char *out = malloc(out_cap);
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  void *zd = NULL;
+  bool ok = in && out;
+  bool in_frame = false; // part way through a gzip member or zstd frame
+  int err = ok ? 0 : ENOMEM;
+
+  if (ok && ld->format == FORMAT_GZIP) {
+    // 15 + 32: any window size, gzip or zlib header
+    ok = inflateInit2(&z, 15 + 32) == Z_OK;
+  }
+  else if (ok) {
+    zd = zstd.create_dstream();
+    ok = zd && !zstd.is_error(zstd.init_dstream(zd));
+  }
+  if (!ok && err == 0)
+    err = ENOMEM;
+
+  while (ok && !__atomic_load_n(&ld->cancel, __ATOMIC_RELAXED)) {
+    ssize_t n = read(ld->fd, in, FEMTO_STREAM_READ);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      err = errno;
+    if (n <= 0)
+      break;
+
+    if (ld->format == FORMAT_GZIP) {
+      z.next_in = (unsigned char *)in;
+      z.avail_in = n;
+      while (ok && z.avail_in > 0) {
+        z.next_out = (unsigned char *)out;
+        z.avail_out = out_cap;
+        int r = inflate(&z, Z_NO_FLUSH);
+        size_t got = out_cap - z.avail_out;
+        in_frame = r != Z_STREAM_END;
+        if (r == Z_STREAM_END)
+          // another member may follow, as with concatenated .gz files
+          inflateReset(&z);
+        else if (r != Z_OK && !(r == Z_BUF_ERROR && got > 0))
+          ok = false;
+        ok = ok && editor_stream_produce(ld, &carry, out, got);
+      }
+    }
+    else {
+      struct zstd_in zin = { in, n, 0 };
+      while (ok && (zin.pos < zin.size || in_frame)) {
+        struct zstd_out zout = { out, out_cap, 0 };
+        size_t r = zstd.decompress_stream(zd, &zout, &zin);
+        ok = !zstd.is_error(r);
+        in_frame = ok && r != 0;
+        ok = ok && editor_stream_produce(ld, &carry, out, zout.pos);
+        // out of input, with everything it had flushed
+        if (zin.pos == zin.size && zout.pos < zout.size)
+          break;
+      }
+    }
+    if (!ok && err == 0)
+      err = -1;
+  }
+  if (ok && err == 0 && in_frame)
+    err = -1;
+
+  pthread_mutex_lock(&ld->lock);
+  if (carry.len > 0) {
+    stream_buf_append(&ld->lines, carry.b, carry.len);
+    stream_buf_append(&ld->lines, "\n", 1);
+  }
+  ld->done = true;
+  ld->err = err;
+  pthread_mutex_unlock(&ld->lock);
+
+  if (ld->format == FORMAT_GZIP)
+    inflateEnd(&z);
+  else if (zd)
+    zstd.free_dstream(zd);
+  free(carry.b);
+  free(in);
+  free(out);
+
+  return NULL;
+}
+
+// Start loading the compressed file open on fd into the (empty) buffer b.
+// Takes the fd.
+bool editor_stream_start(struct buffer *b, int fd, int format)
+{
+  if (format == FORMAT_ZSTD && !editor_zstd_load()) {
+    close(fd);
+    errno = ENOTSUP;
+    return false;
+  }
+
+  struct stream_load *ld = calloc(1, sizeof(struct stream_load));
+  if (ld == NULL)
+    die("calloc");
+  ld->fd = fd;
+  ld->format = format;
+  pthread_mutex_init(&ld->lock, NULL);
+  pthread_cond_init(&ld->cond, NULL);
+
+  int err = pthread_create(&ld->thread, NULL, editor_stream_worker, ld);
+  if (err != 0) {
+    close(fd);
+    free(ld);
+    errno = err;
+    return false;
+  }
+  b->load = ld;
+
+  return true;
+}
+
+bool editor_loading(void)
+{
+  for (struct buffer *b = ed_cfg.buffers; b; b = b->next) {
+    if (b->load)
+      return true;
+  }
+
+  return false;
+}
+
+void editor_stream_free(struct buffer *b)
+{
+  struct stream_load *ld = b->load;
+  pthread_join(ld->thread, NULL);
+  close(ld->fd);
+  pthread_mutex_destroy(&ld->lock);
+  pthread_cond_destroy(&ld->cond);
+  free(ld->lines.b);
+  free(ld);
+  b->load = NULL;
+}
+
+// Give up on loading b, if it's still loading
+void editor_stream_stop(struct buffer *b)
+{
+  struct stream_load *ld = b->load;
+  if (ld == NULL)
+    return;
+
+  pthread_mutex_lock(&ld->lock);
+  __atomic_store_n(&ld->cancel, true, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&ld->cond);
+  pthread_mutex_unlock(&ld->lock);
+  editor_stream_free(b);
+}
+
+// Add the lines that have come in for b, for up to a time slice. Returns
+// true if there were any.
+bool editor_stream_poll(struct buffer *b)
+{
+  struct stream_load *ld = b->load;
+  struct line_filter *f = &b->filter;
+  size_t pattern_len = f->pattern ? strlen(f->pattern) : 0;
+  long long start = monotonic_ms();
+  bool added = false;
+  bool done = false;
+
+  while (!done && monotonic_ms() - start < FEMTO_STREAM_SLICE_MS) {
+    pthread_mutex_lock(&ld->lock);
+    struct stream_buf lines = ld->lines;
+    memset(&ld->lines, 0, sizeof(ld->lines));
+    done = ld->done;
+    pthread_cond_signal(&ld->cond);
+    pthread_mutex_unlock(&ld->lock);
+    if (lines.len == 0 && !done)
+      break;
+
+    for (size_t off = 0; off < lines.len; ) {
+      char *p = &lines.b[off];
+      char *nl = memchr(p, '\n', lines.len - off);
+      size_t len = nl - p;
+      off += len + 1;
+      while (len > 0 && p[len - 1] == '\r')
+        len--;
+
+      int at = b->numrows;
+      editor_insert_row_quiet(b, at, p, len);
+      if (f->pattern && memmem(p, len, f->pattern, pattern_len)) {
+        if (f->count == f->cap) {
+          int cap = f->cap ? f->cap * 2 : 256;
+          int *rows = realloc(f->rows, sizeof(int) * cap);
+          if (rows == NULL)
+            die("realloc");
+          f->rows = rows;
+          f->cap = cap;
+        }
+        f->rows[f->count++] = at;
+      }
+      editor_cold_check(b);
+    }
+    added = added || lines.len > 0;
+    free(lines.b);
+  }
+  if (!done)
+    return added;
+
+  int err = ld->err;
+  editor_stream_free(b);
+  if (err == 0) {
+    editor_swap_open(b, true);
+    return true;
+  }
+
+  // don't let a save write what we've got over the whole file
+  editor_set_status_message("Only part of %s could be read (%s), save it "
+    "under another name", b->filename, 
+    err == -1 ? "corrupt or cut short" : strerror(err));
+  free(b->filename);
+  b->filename = NULL;
+
+  return true;
+}
+
+// Keys that change the buffer or write it out, which have to wait until a
+// file has finished loading
+bool editor_key_edits(int c)
+{
+  switch (c) {
+    case CTRL_KEY('q'):
+    case CTRL_KEY('g'):
+    case CTRL_KEY('w'):
+    case CTRL_KEY('o'):
+    case CTRL_KEY('n'):
+    case CTRL_KEY('p'):
+    case CTRL_KEY('d'):
+    case CTRL_KEY('f'):
+    case CTRL_KEY('t'):
+    case CTRL_KEY('e'):
+    case CTRL_KEY('b'):
+    case CTRL_KEY('k'):
+    case CTRL_KEY('c'):
+    case CTRL_KEY('l'):
+    case '\x1b':
+      return false;
+  }
+
+  return c < 256 || c == DEL_KEY;
+}
+
+// Compress len bytes from data into the file, or with finish, whatever the
+// compressor still holds
+bool editor_writer_compress(struct file_writer *w, const char *data, size_t len,
+  bool finish)
+{
+  if (w->format == FORMAT_GZIP) {
+    w->z.next_in = (unsigned char *)data;
+    w->z.avail_in = len;
+    int r;
+    do {
+      w->z.next_out = (unsigned char *)w->out;
+      w->z.avail_out = FEMTO_WRITE_CHUNK;
+      r = deflate(&w->z, finish ? Z_FINISH : Z_NO_FLUSH);
+      if (r == Z_STREAM_ERROR)
+        return false;
+      size_t got = FEMTO_WRITE_CHUNK - w->z.avail_out;
+      if (!write_all(w->fd, w->out, got))
+        return false;
+      w->written += got;
+    } while (finish ? r != Z_STREAM_END : w->z.avail_in > 0);
+
+    return true;
+  }
+
+  struct zstd_in zin = { data, len, 0 };
+  size_t r;
+  do {
+    struct zstd_out zout = { w->out, FEMTO_WRITE_CHUNK, 0 };
+    r = finish ? zstd.end_stream(w->zc, &zout) : 
+      zstd.compress_stream(w->zc, &zout, &zin);
+    if (zstd.is_error(r) || !write_all(w->fd, w->out, zout.pos))
+      return false;
+    w->written += zout.pos;
+  } while (finish ? r != 0 : zin.pos < zin.size);
+
+  return true;
+}
+
+void *editor_writer_worker(void *arg)
+{
+  struct file_writer *w = arg;
+  int err = 0;
+
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    while (w->full == NULL && !w->closing)
+      pthread_cond_wait(&w->cond, &w->lock);
+    if (w->full == NULL)
+      break;
+
+    char *data = w->full;
+    size_t len = w->full_len;
+    pthread_mutex_unlock(&w->lock);
+    // after an error, keep taking chunks so the main thread isn't stuck
+    if (err == 0 && !editor_writer_compress(w, data, len, false))
+      err = errno ? errno : EIO;
+    pthread_mutex_lock(&w->lock);
+    w->err = err;
+    w->spare = data;
+    w->full = NULL;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  // the main thread only looks at err again once it has joined us
+  if (err == 0 && !editor_writer_compress(w, NULL, 0, true))
+    w->err = errno ? errno : EIO;
+
+  return NULL;
+}
+
+bool editor_writer_open(struct file_writer *w, int fd, int format)
+{
+  memset(w, 0, sizeof(*w));
+  w->fd = fd;
+  w->format = format;
+  w->chunk = malloc(FEMTO_WRITE_CHUNK);
+  if (w->chunk == NULL)
+    return false;
+  if (format == FORMAT_PLAIN)
+    return true;
+
+  if (format == FORMAT_ZSTD && !editor_zstd_load()) {
+    errno = ENOTSUP;
+    return false;
+  }
+  w->spare = malloc(FEMTO_WRITE_CHUNK);
+  w->out = malloc(FEMTO_WRITE_CHUNK);
+  if (w->spare == NULL || w->out == NULL)
+    return false;
+  if (format == FORMAT_GZIP) {
+    // 15 + 16: the biggest window, with a gzip header
+    if (deflateInit2(&w->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+      return false;
+  }
+  else {
+    w->zc = zstd.create_cstream();
+    if (w->zc == NULL || zstd.is_error(zstd.init_cstream(w->zc, 3)))
+      return false;
+  }
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  int err = pthread_create(&w->thread, NULL, editor_writer_worker, w);
+  if (err != 0) {
+    errno = err;
+    return false;
+  }
+  w->started = true;
+
+  return true;
+}
+
+// Send off the filled chunk: straight to the file, or to the worker in
+// exchange for the chunk it has finished with
+bool editor_writer_flush(struct file_writer *w)
+{
+  if (w->format == FORMAT_PLAIN) {
+    if (!write_all(w->fd, w->chunk, w->used))
+      return false;
+    w->written += w->used;
+    w->used = 0;
+    return true;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  while (w->full != NULL)
+    pthread_cond_wait(&w->cond, &w->lock);
+  w->full = w->chunk;
+  w->full_len = w->used;
+  w->chunk = w->spare;
+  w->spare = NULL;
+  int err = w->err;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  w->used = 0;
+  errno = err;
+
+  return err == 0;
+}
+
+bool editor_writer_put(struct file_writer *w, const char *s, size_t len)
+{
+  while (len > 0) {
+    size_t n = FEMTO_WRITE_CHUNK - w->used;
+    if (n > len)
+      n = len;
+    memcpy(&w->chunk[w->used], s, n);
+    w->used += n;
+    s += n;
+    len -= n;
+    if (w->used == FEMTO_WRITE_CHUNK && !editor_writer_flush(w))
+      return false;
+  }
+
+  return true;
+}
+
+// Flush what's left and finish the compressed stream. Returns false with
+// errno set if anything went wrong along the way.
+bool editor_writer_close(struct file_writer *w, bool ok)
+{
+  ok = ok && w->chunk && (w->used == 0 || editor_writer_flush(w));
+  int err = errno;
+
+  if (w->started) {
+    pthread_mutex_lock(&w->lock);
+    w->closing = true;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    if (ok && w->err != 0) {
+      ok = false;
+      err = w->err;
+    }
+  }
+  if (w->format == FORMAT_GZIP)
+    deflateEnd(&w->z);
+  else if (w->zc)
+    zstd.free_cstream(w->zc);
+
+  free(w->chunk);
+  free(w->spare);
+  free(w->out);
+  errno = err;
+
+  return ok;
+}
+
+// file i/o
+
+#define FEMTO_MAP_BLOCK (64 * 1024 * 1024)
+
+// Map filename read-only, or share the mapping another buffer already has
+// of the same file. NULL if it can't be mapped (it's empty, or a pipe).
+struct file_map *editor_map_file(const char *filename)
+{
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  // a log that has grown since it was mapped gets a mapping of its own
+  for (struct file_map *m = ed_cfg.maps; m; m = m->next) {
+    if (m->dev == st.st_dev && m->ino == st.st_ino && m->len == (size_t)st.st_size &&
+        !m->copied) {
+      close(fd);
+      return m;
+    }
+  }
+
+  char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+
+  struct file_map *m = calloc(1, sizeof(struct file_map));
+  if (m == NULL)
+    die("calloc");
+  m->dev = st.st_dev;
+  m->ino = st.st_ino;
+  m->mtime = st.st_mtim;
+  m->fd = fd;
+  m->name = strdup(filename);
+  if (m->name == NULL)
+    die("strdup");
+  m->base = base;
+  m->len = st.st_size;
+  m->next = ed_cfg.maps;
+  ed_cfg.maps = m;
+
+  return m;
+}
+
+void editor_unmap_file(struct file_map *m)
+{
+  if (--m->refs > 0)
+    return;
+
+  if (m->copied)
+    free(m->base);
+  else
+    munmap(m->base, m->len);
+  if (m->fd != -1)
+    close(m->fd);
+  struct file_map **p = &ed_cfg.maps;
+  while (*p != m)
+    p = &(*p)->next;
+  *p = m->next;
+  free(m->name);
+  free(m);
+}
+
+// Stop borrowing from the file: copy what's left of it (the first size
+// bytes) and point every block at the copy instead
+void editor_map_copy(struct file_map *m, size_t size)
+{
+  size_t keep = size < m->len ? size : m->len;
+  char *copy = malloc(m->len);
+  if (copy == NULL)
+    die("malloc");
+  memcpy(copy, m->base, keep);
+  memset(copy + keep, 0, m->len - keep);
+
+  for (struct cold_block *b = ed_cfg.cold.blocks; b; b = b->next) {
+    if (b->map != m)
+      continue;
+    if (b->raw == b->data)
+      b->raw = copy + (b->raw - m->base);
+    b->data = copy + (b->data - m->base);
+  }
+
+  munmap(m->base, m->len);
+  close(m->fd);
+  m->fd = -1;
+  m->base = copy;
+  m->copied = true;
+}
+
+// Borrowing from a mapping is only safe while the file stays as it was:
+// reading pages past the end of a file that was cut short faults, and a
+// file rewritten in place changes the rows that haven't been thawed yet.
+// This looks before every refresh and save, and copies what's left once
+// the file has changed other than by growing. A file that grows is taken
+// to be a log being appended to. Truncating it between two looks still
+// kills us, which is the price of -m. True if anything changed.
+bool editor_map_check(void)
+{
+  bool changed = false;
+  for (struct file_map *m = ed_cfg.maps; m; m = m->next) {
+    struct stat st;
+    if (m->copied || fstat(m->fd, &st) == -1 || (size_t)st.st_size > m->len ||
+        ((size_t)st.st_size == m->len && st.st_mtim.tv_sec == m->mtime.tv_sec &&
+         st.st_mtim.tv_nsec == m->mtime.tv_nsec))
+      continue;
+
+    editor_map_copy(m, st.st_size);
+    if ((size_t)st.st_size < m->len)
+      editor_set_status_message("%s shrank on disk, lines past its new end are lost",
+        m->name);
+    else
+      editor_set_status_message("%s changed on disk, no longer reading from it", m->name);
+    changed = true;
+  }
+
+  return changed;
+}
+
+// With -m, build the rows of the (empty) current buffer over a mapping of
+// the file. Every row starts out cold, in blocks that point into the
+// mapping, so loading only has to find the line ends and no text is copied
+// until a row is drawn or edited.
+bool editor_load_mapped(const char *filename)
+{
+  struct file_map *m = editor_map_file(filename);
+  if (m == NULL)
+    return false;
+
+  struct buffer *buf = ed_cfg.buf;
+  struct cold_block *b = NULL;
+  size_t block_start = 0;
+  size_t off = 0;
+  while (off < m->len) {
+    char *nl = memchr(m->base + off, '\n', m->len - off);
+    size_t end = nl ? (size_t)(nl - m->base) : m->len;
+    size_t next = nl ? end + 1 : m->len;
+    size_t len = end - off;
+    while (len > 0 && m->base[off + len - 1] == '\r')
+      len--;
+
+    if (b == NULL || off - block_start >= FEMTO_MAP_BLOCK) {
+      b = calloc(1, sizeof(struct cold_block));
+      if (b == NULL)
+        die("calloc");
+      b->map = m;
+      m->refs++;
+      b->data = m->base + off;
+      block_start = off;
+      editor_cold_link_block(b);
+    }
+    b->rawlen = next - block_start;
+    b->live++;
+
+    if (buf->numrows == buf->rows_cap) {
+      int cap = buf->rows_cap ? buf->rows_cap * 2 : 64;
+      struct erow *rows = realloc(buf->rows, sizeof(struct erow) * cap);
+      if (rows == NULL)
+        die("realloc");
+      buf->rows = rows;
+      buf->rows_cap = cap;
+    }
+    struct erow *row = &buf->rows[buf->numrows++];
+    memset(row, 0, sizeof(*row));
+    row->size = len;
+    row->chars_cls = row->render_cls = row->hl_cls = POOL_NONE;
+    row->hl_state = HL_STATE_NORMAL;
+    row->cold = b;
+    row->cold_off = off - block_start;
+
+    off = next;
+  }
+
+  return true;
+}
+
+// Load filename into the current buffer, replacing whatever it held.
+// Returns false with errno set if the file can't be read.
+bool editor_open(char *filename)
+{
+  editor_stream_stop(ed_cfg.buf);
+  free(ed_cfg.buf->filename);
+  ed_cfg.buf->filename = strdup(filename);
+  editor_select_syntax_highlight();
+  editor_undo_clear(ed_cfg.buf);
+  editor_free_rows(ed_cfg.buf);
+  editor_filter_clear(ed_cfg.buf);
+  editor_line_index_clear(ed_cfg.buf);
+  ed_cfg.buf->cx = ed_cfg.buf->cy = 0;
+  ed_cfg.buf->row_offset = ed_cfg.buf->col_offset = 0;
+  ed_cfg.buf->format = FORMAT_PLAIN;
+
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd != -1)
+    ed_cfg.buf->format = editor_detect_format(fd);
+  if (ed_cfg.buf->format != FORMAT_PLAIN) {
+    // the swap file waits until it's all loaded
+    if (!editor_stream_start(ed_cfg.buf, fd, ed_cfg.buf->format))
+      return false;
+    ed_cfg.buf->dirty = false;
+    editor_set_margin_width();
+    return true;
+  }
+  if (fd != -1)
+    close(fd);
+
+  ed_cfg.buf->undo.suspended++;
+  if (!ed_cfg.cold.enabled || !editor_load_mapped(filename)) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+      ed_cfg.buf->undo.suspended--;
+      return false;
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &linecap, fp)) != -1) {
+      while (line_len > 0 && (line[line_len - 1] == '\n' ||
+                             line[line_len - 1] == '\r'))
+        line_len--;
+
+      editor_insert_row(ed_cfg.buf->numrows, line, line_len);
+      editor_cold_check(ed_cfg.buf);
+    }
+
+    free(line);
+    fclose(fp);
+  }
+  ed_cfg.buf->undo.suspended--;
+  ed_cfg.buf->dirty = false;
+
+  editor_swap_open(ed_cfg.buf, true);
+
+  editor_set_margin_width();
+
+  return true;
+}
+
+bool write_all(int fd, const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+// Write the buffer to a temporary file next to filename and rename it into
+// place. Rows may still be borrowing their text from a mapping of the old
+// file, which truncating and rewriting it in place would pull out from under
+// them. Returns the number of bytes written (compressed, for .gz and .zst),
+// or -1 with errno set.
+long long editor_write_file(const char *filename)
+{
+  // write next to the real file, so a symlink stays a symlink
+  char *target = realpath(filename, NULL);
+  if (target == NULL)
+    target = strdup(filename);
+
+  char *slash = strrchr(target, '/');
+  int dirlen = slash ? slash - target + 1 : 0;
+  char *tmp = malloc(strlen(target) + 16);
+  sprintf(tmp, "%.*s.%s.XXXXXX", dirlen, target, target + dirlen);
+
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    free(tmp);
+    free(target);
+    return -1;
+  }
+
+  struct stat st;
+  fchmod(fd, stat(target, &st) == 0 ? st.st_mode & 07777 : 0644);
+
+  struct file_writer w;
+  bool ok = editor_writer_open(&w, fd, editor_save_format(filename));
+  for (int j = 0; ok && j < ed_cfg.buf->numrows; j++) {
+    struct erow *row = &ed_cfg.buf->rows[j];
+    ok = editor_writer_put(&w, editor_row_text(row), row->size) &&
+      editor_writer_put(&w, "\n", 1);
+  }
+  ok = editor_writer_close(&w, ok) && fsync(fd) == 0;
+  long long total = w.written;
+
+  int err = errno;
+  if (close(fd) == -1 && ok) {
+    err = errno;
+    ok = false;
+  }
+  if (ok && rename(tmp, target) == -1) {
+    err = errno;
+    ok = false;
+  }
+  if (!ok)
+    unlink(tmp);
+
+  free(tmp);
+  free(target);
+  errno = err;
+
+  return ok ? total : -1;
+}
+
+void editor_save(void)
+{
+  if (!ed_cfg.buf->filename) {
+		ed_cfg.buf->filename = editor_prompt("Save as: %s", NULL);
+		if (ed_cfg.buf->filename == NULL) {
+			editor_set_status_message("Nevermind.");
+			return;
+		}
+    editor_select_syntax_highlight();
+	}
+
+  // don't write out rows the file changed under
+  editor_map_check();
+  long long len = editor_write_file(ed_cfg.buf->filename);
+  if (len != -1) {
+    ed_cfg.buf->dirty = false;
+    editor_undo_mark_saved();
+    if (ed_cfg.buf->swap.fd == -1)
+      editor_swap_open(ed_cfg.buf, false);
+    else
+      editor_swap_reset(ed_cfg.buf);
+    editor_set_status_message("%lld bytes written to disk", len);
+    return;
+  }
+
+  editor_set_status_message("Buffer not saved! I/O error: %s", strerror(errno));
+}
+
+// buffers
+
+// A new, empty buffer after the current one, which becomes current
+struct buffer *editor_buffer_new(void)
+{
+  struct buffer *b = calloc(1, sizeof(struct buffer));
+  if (b == NULL)
+    die("calloc");
+  b->display_cols = ed_cfg.screencols;
+  b->undo.budget = ed_cfg.undo_budget;
+  b->undo.dropped_group = -1;
+  b->swap.fd = -1;
+  b->pool.total = &ed_cfg.row_bytes;
+
+  struct buffer *at = ed_cfg.buf;
+  b->prev = at;
+  b->next = at ? at->next : NULL;
+  if (b->next)
+    b->next->prev = b;
+  if (at)
+    at->next = b;
+  else
+    ed_cfg.buffers = b;
+  ed_cfg.nbuffers++;
+  ed_cfg.buf = b;
+  ed_cfg.session_behind = true;
+
+  return b;
+}
+
+// Throw away buffer b; if it was the current one, one next to it takes its
+// place. There's always at least one, so closing the last leaves an empty
+// one behind.
+void editor_buffer_free(struct buffer *b)
+{
+  editor_stream_stop(b);
+  editor_swap_close(b, true);
+  editor_undo_clear(b);
+  editor_free_rows(b);
+  editor_filter_clear(b);
+  editor_line_index_clear(b);
+  free(b->filename);
+
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    ed_cfg.buffers = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+  ed_cfg.nbuffers--;
+  ed_cfg.session_behind = true;
+  if (ed_cfg.buf == b)
+    ed_cfg.buf = b->next ? b->next : b->prev;
+  free(b);
+
+  if (ed_cfg.buffers == NULL) {
+    ed_cfg.buf = NULL;
+    editor_buffer_new();
+  }
+}
+
+void editor_buffer_close(void)
+{
+  if (ed_cfg.buf->dirty && !editor_confirm("Close without saving?"))
+    return;
+
+  editor_buffer_free(ed_cfg.buf);
+}
+
+int editor_buffer_index(struct buffer *b)
+{
+  int n = 1;
+  for (struct buffer *p = ed_cfg.buffers; p != b; p = p->next)
+    ++n;
+
+  return n;
+}
+
+bool editor_any_dirty(void)
+{
+  for (struct buffer *b = ed_cfg.buffers; b; b = b->next) {
+    if (b->dirty)
+      return true;
+  }
+
+  return false;
+}
+
+// Switch to the next (dir 1) or previous (dir -1) buffer, wrapping around
+void editor_buffer_switch(int dir)
+{
+  struct buffer *b = dir > 0 ? ed_cfg.buf->next : ed_cfg.buf->prev;
+  if (b == NULL) {
+    b = ed_cfg.buffers;
+    while (dir < 0 && b->next)
+      b = b->next;
+  }
+  ed_cfg.buf = b;
+
+  editor_set_status_message("%s (%d of %d)", 
+    b->filename ? b->filename : "[No Name]", editor_buffer_index(b), 
+    ed_cfg.nbuffers);
+}
+
+void editor_buffer_open(void)
+{
+  char *filename = editor_prompt("Open: %s", NULL);
+  if (filename == NULL)
+    return;
+
+  struct buffer *cur = ed_cfg.buf;
+  editor_buffer_new();
+  if (!editor_open(filename)) {
+    editor_set_status_message("Can't open %s: %s", filename, strerror(errno));
+    editor_buffer_free(ed_cfg.buf);
+    ed_cfg.buf = cur;
+  }
+  free(filename);
+}
+
+// find
+
+void editor_find_callback(char *query, int key)
+{
+  static int last_match = -1;
+  static int direction = 1;
+
+  if (key == '\r' || key == '\x1b') {
+    last_match = -1;
+    direction = 1;
+    return;
+  }
+  else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  }
+  else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  }
+  else {
+    last_match = -1;
+    direction = 1;
+  }
+
+  if (last_match == -1)
+    direction = 1;
+  // last_match is a view position, so a filter limits the search too
+  int current = last_match;
+  int view_rows = editor_view_rows();
+  for (int i = 0; i < view_rows; i++) {
+    current += direction;
+    if (current == -1)
+      current = view_rows - 1;
+    else if (current >= view_rows)
+      current = 0;
+
+    // search the text itself so cold rows don't have to be thawed
+    int file_row = editor_view_to_row(current);
+    struct erow *row = &ed_cfg.buf->rows[file_row];
+    char *text = editor_row_text(row);
+    char *match = memmem(text, row->size, query, strlen(query));
+    if (match) {
+      last_match = current;
+      ed_cfg.buf->cy = file_row;
+      ed_cfg.buf->cx = (match - text) + ed_cfg.buf->margin_width;
+      ed_cfg.buf->row_offset = view_rows;
+      break;
+    }
+  }
+}
+
+// Remember query as the latest search, moving it up if it's there already
+void editor_search_history_add(const char *query)
+{
+  struct search_history *h = &ed_cfg.searches;
+  char *copy = strdup(query);
+  if (copy == NULL)
+    return;
+
+  for (int j = 0; j < h->count; j++) {
+    if (!strcmp(h->items[j], query)) {
+      free(h->items[j]);
+      memmove(&h->items[j], &h->items[j + 1], sizeof(char *) * (h->count - j - 1));
+      h->count--;
+      break;
+    }
+  }
+  if (h->count == FEMTO_SEARCH_HISTORY) {
+    free(h->items[0]);
+    memmove(&h->items[0], &h->items[1], sizeof(char *) * (h->count - 1));
+    h->count--;
+  }
+  h->items[h->count++] = copy;
+}
+
+void editor_find(void)
+{
+  int saved_cx = ed_cfg.buf->cx;
+  int saved_cy = ed_cfg.buf->cy;
+  int saved_coloff = ed_cfg.buf->col_offset;
+  int saved_rowoff = ed_cfg.buf->row_offset;
+
+  char *query = editor_prompt("\x1b[2mSearch: \x1b[m%s\x1b[2m (Use ESC/Arrows/Enter, Ctrl-P/N = history)\x1b[m", editor_find_callback);
+
+  if (query) {
+    editor_search_history_add(query);
+    free(query);
+  }
+  else {
+    ed_cfg.buf->cx = saved_cx;
+    ed_cfg.buf->cy = saved_cy;
+    ed_cfg.buf->col_offset = saved_coloff;
+    ed_cfg.buf->row_offset = saved_rowoff;
+  }
+}
+
+int get_cursor_position(int *rows, int *cols)
+{
+  char buf[32];
+  uint32_t i = 0;
+
+  if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4)
+    return -1;
+  
+  while (i < sizeof(buf) - 1) {
+    if (read(STDIN_FILENO, &buf[i], 1) != 1)
       break;
     if (buf[i] == 'R')
       break;
@@ -572,22 +6107,29 @@ int get_window_size(int *rows, int *cols)
 
 void editor_scroll(void)
 {
-  ed_cfg.rx = 0;
-  if (ed_cfg.cy < ed_cfg.numrows) {
-    ed_cfg.rx = editor_row_cx_to_rx(&ed_cfg.rows[ed_cfg.cy], ed_cfg.cx);
+  // rx is the screen column of the cursor: the margin plus how many cells
+  // the text before it takes up. col_offset only scrolls the text part.
+  ed_cfg.buf->rx = ed_cfg.buf->margin_width;
+  if (ed_cfg.buf->cy < ed_cfg.buf->numrows) {
+    ed_cfg.buf->rx += editor_row_cx_to_rx(&ed_cfg.buf->rows[ed_cfg.buf->cy],
+      ed_cfg.buf->cx - ed_cfg.buf->margin_width);
   }
+  int text_rx = ed_cfg.buf->rx - ed_cfg.buf->margin_width;
+  int text_cols = ed_cfg.screencols - ed_cfg.buf->margin_width - 1;
 
-  if (ed_cfg.cy < ed_cfg.row_offset) {
-    ed_cfg.row_offset = ed_cfg.cy;
+  // with a filter on, row_offset counts rows in the view, not the file
+  int vy = editor_row_to_view(ed_cfg.buf->cy);
+  if (vy < ed_cfg.buf->row_offset) {
+    ed_cfg.buf->row_offset = vy;
   }
-  if (ed_cfg.cy >= ed_cfg.row_offset + ed_cfg.screenrows) {
-    ed_cfg.row_offset = ed_cfg.cy - ed_cfg.screenrows + 1;
+  if (vy >= ed_cfg.buf->row_offset + ed_cfg.screenrows) {
+    ed_cfg.buf->row_offset = vy - ed_cfg.screenrows + 1;
   }
-  if (ed_cfg.cx < ed_cfg.col_offset) {
-    ed_cfg.col_offset = ed_cfg.rx;
+  if (text_rx < ed_cfg.buf->col_offset) {
+    ed_cfg.buf->col_offset = text_rx;
   }
-  if (ed_cfg.rx >= ed_cfg.col_offset + ed_cfg.screencols) {
-    ed_cfg.col_offset = ed_cfg.rx - ed_cfg.screencols + 1;
+  if (text_cols > 0 && text_rx >= ed_cfg.buf->col_offset + text_cols) {
+    ed_cfg.buf->col_offset = text_rx - text_cols + 1;
   }
 }
 
@@ -612,47 +6154,135 @@ void editor_draw_welcome(struct abuf *ab)
 
 void editor_set_margin_width(void)
 {
-  if (ed_cfg.numrows > 0)
+  if (ed_cfg.buf->numrows > 0)
   {
     // figure out how wide we need the left margin to be
     char buff[80];
-    sprintf(buff, "%d", ed_cfg.numrows);
+    sprintf(buff, "%d", ed_cfg.buf->numrows);
     int left_padding = strlen(buff);
     
-    ed_cfg.margin_width = left_padding + 1;
-    ed_cfg.display_cols = ed_cfg.screencols - ed_cfg.margin_width;
-    if (ed_cfg.cx < ed_cfg.margin_width)
-      ed_cfg.cx = ed_cfg.margin_width;
+    ed_cfg.buf->margin_width = left_padding + 1;
+    ed_cfg.buf->display_cols = ed_cfg.screencols - ed_cfg.buf->margin_width;
+    if (ed_cfg.buf->cx < ed_cfg.buf->margin_width)
+      ed_cfg.buf->cx = ed_cfg.buf->margin_width;
+  }
+}
+// The part of row that's selected, as byte offsets into its render
+bool editor_select_render_range(struct erow *row, int *from, int *to)
+{
+  int r1, c1, r2, c2;
+  int at = row - ed_cfg.buf->rows;
+  if (!editor_select_range(&r1, &c1, &r2, &c2) || at < r1 || at > r2)
+    return false;
+
+  int pad;
+  int first = at == r1 ? c1 : 0;
+  int last = at == r2 ? c2 : row->size;
+  *from = editor_row_render_col_to_byte(row, editor_row_cx_to_rx(row, first), &pad);
+  *to = editor_row_render_col_to_byte(row, editor_row_cx_to_rx(row, last), &pad);
+
+  return *from < *to;
+}
+
+// Append the part of the row between col_offset and col_offset + width
+// display columns. For plain ASCII that's just a slice of render, otherwise
+// we walk code points so wide characters aren't split at either edge.
+void editor_draw_row_text(struct abuf *ab, struct erow *row, int width)
+{
+  if (width <= 0)
+    return;
+
+  int start, end;
+  if (row->ascii) {
+    start = ed_cfg.buf->col_offset < row->rsize ? ed_cfg.buf->col_offset : row->rsize;
+    end = start + width < row->rsize ? start + width : row->rsize;
+  }
+  else {
+    int pad;
+    start = editor_row_render_col_to_byte(row, ed_cfg.buf->col_offset, &pad);
+    int cols = 0;
+    for (; pad > 0 && cols < width; pad--, cols++)
+      abuf_append(ab, " ", 1);
+
+    end = start;
+    while (end < row->rsize) {
+      uint32_t cp;
+      int n = utf8_decode(&row->render[end], row->rsize - end, &cp);
+      int w = cp_width(cp);
+      if (cols + w > width)
+        break;
+      cols += w;
+      end += n;
+    }
+  }
+
+  int sel_start, sel_end;
+  bool sel = editor_select_render_range(row, &sel_start, &sel_end);
+  bool colored = ed_cfg.buf->syntax != NULL && row->hl != NULL;
+  if (!colored && !sel) {
+    abuf_append(ab, &row->render[start], end - start);
+    return;
   }
+
+  // only emit an escape sequence when the colour actually changes
+  int current_color = -1;
+  bool current_sel = false;
+  int run = start;
+  for (int j = start; j < end; j++) {
+    int color = colored ? editor_syntax_to_color(row->hl[j]) : 39;
+    bool in_sel = sel && j >= sel_start && j < sel_end;
+    if (color != current_color || in_sel != current_sel) {
+      abuf_append(ab, &row->render[run], j - run);
+      run = j;
+    }
+    if (color != current_color) {
+      char buf[16];
+      int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+      abuf_append(ab, buf, clen);
+      current_color = color;
+    }
+    if (in_sel != current_sel) {
+      abuf_append(ab, in_sel ? "\x1b[7m" : "\x1b[27m", in_sel ? 4 : 5);
+      current_sel = in_sel;
+    }
+  }
+  abuf_append(ab, &row->render[run], end - run);
+  if (current_sel)
+    abuf_append(ab, "\x1b[27m", 5);
+  if (current_color != -1)
+    abuf_append(ab, "\x1b[39m", 5);
 }
+
 // draw each row that is on screen. Either the row of text in our buffer
 // or an empty line with a ~
 void editor_draw_rows(struct abuf *ab)
 { 
   editor_set_margin_width();
+  int view_rows = editor_view_rows();
+  int last_row = 0;
+  for (int y = 0; y < ed_cfg.screenrows && y + ed_cfg.buf->row_offset < view_rows; y++) {
+    last_row = editor_view_to_row(y + ed_cfg.buf->row_offset);
+    editor_row_thaw(&ed_cfg.buf->rows[last_row]);
+  }
+  editor_hl_ensure(last_row);
 
   for (int y = 0; y < ed_cfg.screenrows; y++) {
-    int file_row = y + ed_cfg.row_offset;
-    if (file_row >= ed_cfg.numrows) {
-      if (ed_cfg.numrows == 0 && y == ed_cfg.screenrows / 3)
+    int file_row = editor_view_to_row(y + ed_cfg.buf->row_offset);
+    if (file_row >= ed_cfg.buf->numrows) {
+      if (ed_cfg.buf->numrows == 0 && y == ed_cfg.screenrows / 3)
        editor_draw_welcome(ab);
       else
         abuf_append(ab, "~", 1);
     }
     else {
-      int len = ed_cfg.rows[file_row].rsize - ed_cfg.col_offset;
-      if (len < 0)
-        len = 0;
-      if (len > ed_cfg.screencols - ed_cfg.margin_width - 1) 
-        len = ed_cfg.screencols - ed_cfg.margin_width - 1;
-      
-      char *buf = malloc(ed_cfg.margin_width + 1);
-      sprintf(buf, "%*d ", ed_cfg.margin_width - 1, file_row + 1);
-      if (file_row != ed_cfg.cy)
+      char *buf = malloc(ed_cfg.buf->margin_width + 1);
+      sprintf(buf, "%*d ", ed_cfg.buf->margin_width - 1, file_row + 1);
+      if (file_row != ed_cfg.buf->cy)
         abuf_append(ab, "\x1b[2m", 4); // draw fainter text
-      abuf_append(ab, buf, ed_cfg.margin_width + 1);
+      abuf_append(ab, buf, ed_cfg.buf->margin_width);
       abuf_append(ab, "\x1b[m", 3); // reset to normal text
-      abuf_append(ab, &ed_cfg.rows[file_row].render[ed_cfg.col_offset], len);
+      editor_draw_row_text(ab, &ed_cfg.buf->rows[file_row], 
+        ed_cfg.screencols - ed_cfg.buf->margin_width - 1);
       free(buf);
     }
 
@@ -666,13 +6296,19 @@ void editor_draw_status_bar(struct abuf *ab)
   //abuf_append(ab, "\x1b[7m", 4);
   abuf_append(ab, "\x1b[47m", 5);
   abuf_append(ab, "\x1b[30m", 5);
-  char status[80], rstatus[80];
-
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-    ed_cfg.filename ? ed_cfg.filename : "[No Name]", ed_cfg.numrows,
-    ed_cfg.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", ed_cfg.cy + 1, 
-    ed_cfg.numrows);
+  char status[80], rstatus[80], nbuf[32] = "";
+
+  if (ed_cfg.nbuffers > 1)
+    snprintf(nbuf, sizeof(nbuf), "[%d/%d] ", editor_buffer_index(ed_cfg.buf), 
+      ed_cfg.nbuffers);
+  int len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s%s%s", nbuf,
+    ed_cfg.buf->filename ? ed_cfg.buf->filename : "[No Name]", ed_cfg.buf->numrows,
+    ed_cfg.buf->dirty ? "(modified)" : "", 
+    ed_cfg.buf->load ? "(loading)" : "",
+    ed_cfg.buf->filter.active ? " [filtered]" : "");
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", 
+    ed_cfg.buf->syntax ? ed_cfg.buf->syntax->filetype : "text", ed_cfg.buf->cy + 1, 
+    ed_cfg.buf->numrows);
   if (len > ed_cfg.screencols)
     len = ed_cfg.screencols;
   abuf_append(ab, status, len);
@@ -703,6 +6339,7 @@ void editor_draw_message_bar(struct abuf *ab)
 
 void editor_refresh_screen(void)
 {
+  editor_map_check();
   editor_scroll();
 
   struct abuf ab = { NULL, 0 };
@@ -716,8 +6353,8 @@ void editor_refresh_screen(void)
   
   char buf[32];
   snprintf(buf, sizeof(buf), "\x1b[%d;%dH", 
-    (ed_cfg.cy - ed_cfg.row_offset) + 1, 
-    (ed_cfg.rx - ed_cfg.col_offset) + 1);
+    (editor_row_to_view(ed_cfg.buf->cy) - ed_cfg.buf->row_offset) + 1, 
+    (ed_cfg.buf->rx - ed_cfg.buf->col_offset) + 1);
 
   abuf_append(&ab, buf, strlen(buf));
 
@@ -745,6 +6382,7 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
 
 	size_t buflen = 0;
 	buf[0] = '\0';
+  int history = ed_cfg.searches.count;
 
 	while (true) {
 		editor_set_status_message(prompt, buf);
@@ -752,8 +6390,10 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
 
 		int c = editor_read_key();
 		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-			if (buflen != 0)
-				buf[--buflen] = '\0';
+      // drop the whole last character, including its continuation bytes
+			while (buflen != 0 && (buf[--buflen] & 0xc0) == 0x80)
+        ;
+      buf[buflen] = '\0';
 		}
 		else if (c == '\x1b') {
 			editor_set_status_message("");
@@ -770,7 +6410,24 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
 				return buf;
 			}
 		}
-		else if (!iscntrl(c) && c < 128) {
+		else if ((c == CTRL_KEY('p') || c == CTRL_KEY('n')) && 
+        callback == editor_find_callback) {
+      // step through past searches, and past the latest back to nothing
+      struct search_history *h = &ed_cfg.searches;
+      history += c == CTRL_KEY('p') ? -1 : 1;
+      if (history < 0)
+        history = 0;
+      if (history > h->count)
+        history = h->count;
+      const char *item = history < h->count ? h->items[history] : "";
+      buflen = strlen(item);
+      if (buflen >= bufsize) {
+        bufsize = buflen + 1;
+        buf = realloc(buf, bufsize);
+      }
+      memcpy(buf, item, buflen + 1);
+    }
+		else if (c < 256 && (c >= 128 || !iscntrl(c))) {
 			if (buflen == bufsize - 1) {
 				bufsize *= 2;
 				buf = realloc(buf, bufsize);
@@ -778,17 +6435,119 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int))
 			buf[buflen++] = c;
 			buf[buflen] = '\0';
 		}
+		else if (c == UTF8_KEY) {
+			while (buflen + ed_cfg.key_len >= bufsize) {
+				bufsize *= 2;
+				buf = realloc(buf, bufsize);
+			}
+			memcpy(&buf[buflen], ed_cfg.key_text, ed_cfg.key_len);
+			buflen += ed_cfg.key_len;
+			buf[buflen] = '\0';
+		}
 
     if (callback)
       callback(buf, c);
 	}
 }
 
+// Ask a yes/no question in the message bar
+bool editor_confirm(const char *question)
+{
+  while (true) {
+    editor_set_status_message("%s (y/n)", question);
+    editor_refresh_screen();
+
+    int c = editor_read_key();
+    if (c == 'y' || c == 'Y') {
+      editor_set_status_message("");
+      return true;
+    }
+    else if (c == 'n' || c == 'N' || c == '\x1b') {
+      editor_set_status_message("");
+      return false;
+    }
+  }
+}
+
+// Put the cursor at byte at of row (or keep its column if at is -1), with
+// the row around a third of the way down the screen
+void editor_jump_to_row(int row, int at)
+{
+  if (row > ed_cfg.buf->numrows)
+    row = ed_cfg.buf->numrows;
+  if (row < 0)
+    row = 0;
+
+  // in a filtered view, go to the first visible line from there on
+  if (ed_cfg.buf->filter.active && ed_cfg.buf->filter.count > 0) {
+    int v = editor_row_to_view(row);
+    if (v >= ed_cfg.buf->filter.count)
+      v = ed_cfg.buf->filter.count - 1;
+    if (ed_cfg.buf->filter.rows[v] != row)
+      at = 0;
+    row = ed_cfg.buf->filter.rows[v];
+  }
+
+  ed_cfg.buf->cy = row;
+  if (row >= ed_cfg.buf->numrows) {
+    ed_cfg.buf->cx = ed_cfg.buf->margin_width;
+  }
+  else if (at >= 0) {
+    struct erow *r = &ed_cfg.buf->rows[row];
+    const char *text = editor_row_text(r);
+    if (at > r->size)
+      at = r->size;
+    while (at > 0 && at < r->size && (text[at] & 0xc0) == 0x80)
+      --at;
+    ed_cfg.buf->cx = at + ed_cfg.buf->margin_width;
+  }
+  else if (ed_cfg.buf->cx > ed_cfg.buf->rows[row].size + ed_cfg.buf->margin_width) {
+    ed_cfg.buf->cx = ed_cfg.buf->rows[row].size + ed_cfg.buf->margin_width;
+  }
+
+  // I like to have the line we jumped to be around 1/3 the way down 
+  // the screen
+  ed_cfg.buf->row_offset = editor_row_to_view(row) - ed_cfg.screenrows / 3;
+  if (ed_cfg.buf->row_offset < 0)
+    ed_cfg.buf->row_offset = 0;
+  editor_scroll();
+}
+
+// Goto accepts a line number, a byte offset as @N (with an optional k, m
+// or g suffix) or a position in the file as N%
 void editor_jump_to_line(void)
 {
-  char *txt = editor_prompt("Goto line: %s", NULL);
+  char *txt = editor_prompt("Goto line, @offset or N%%: %s", NULL);
+  if (txt == NULL)
+    return;
+
+  size_t len = strlen(txt);
+  if (txt[0] == '@') {
+    long long off = parse_size(txt + 1);
+    if (off < 0) {
+      editor_set_status_message("Bad offset: %s", txt + 1);
+    }
+    else {
+      int row = editor_byte_offset_to_row(off);
+      editor_jump_to_row(row, off - editor_row_byte_offset(row));
+    }
+    free(txt);
+    return;
+  }
+  if (len > 0 && txt[len - 1] == '%') {
+    char *end;
+    double pct = strtod(txt, &end);
+    if (end != txt + len - 1 || pct < 0 || pct > 100) {
+      editor_set_status_message("Bad percentage: %s", txt);
+    }
+    else {
+      editor_jump_to_row(editor_percent_to_row(pct), 0);
+    }
+    free(txt);
+    return;
+  }
   
-  bool valid = true;
+  bool valid = len > 0;
   char *p = txt;
   while (*p != '\0') {
     if (!isdigit(*p)) {
@@ -799,33 +6558,43 @@ void editor_jump_to_line(void)
   }
 
   if (valid) {
-    char buf[80];
-    sprintf(buf, "mw: %d dc: %d sc: %d", ed_cfg.margin_width, ed_cfg.display_cols, ed_cfg.screencols);
-    editor_set_status_message(buf);
-
     // I find I I often type 0 instead of 1 when I want to
     // go to the first line of a file because 0-index brain, so I'll
     // just treat it as 1.
     int ln = atoi(txt);
     if (ln == 0)
       ln = 1;
-    else if (ln >= ed_cfg.numrows)
-      ln = ed_cfg.numrows;
-    
-    // I like to have the line we jumped to be around 1/3 the way down 
-    // the screen
-    if (ln > 10 && ed_cfg.numrows - ln > ed_cfg.screenrows) {
-      ed_cfg.cy = ln - 1;
-      //ed_cfg.row_offset = ln - 9;
-    }
-    else {
-      ed_cfg.cy = ln - 1;
-    }
+    else if (ln >= ed_cfg.buf->numrows)
+      ln = ed_cfg.buf->numrows;
+
+    editor_jump_to_row(ln - 1, -1);
+  }
+
+  free(txt);
+}
+
+void editor_jump_to_time(void)
+{
+  struct timestamp first;
+  int fmt = editor_ts_detect(&first);
+  if (fmt == TS_NONE) {
+    editor_set_status_message("No timestamps found near the top of the file");
+    return;
+  }
+
+  char *txt = editor_prompt("Goto time: %s", NULL);
+  if (txt == NULL)
+    return;
 
-    //[12;40H
-    editor_scroll();
-    //sprintf(buf, "row offset to : %d", ed_cfg.row_offset);
-    //editor_set_status_message(buf);
+  struct timestamp t;
+  if (!ts_parse_query(txt, &first, &t)) {
+    editor_set_status_message("Bad time: %s (try 14:03:22 or 2024-05-01 14:03)", txt);
+  }
+  else {
+    int row = editor_ts_bisect(fmt, ts_key(&t));
+    if (row >= ed_cfg.buf->numrows)
+      editor_set_status_message("Nothing at or after %s", txt);
+    editor_jump_to_row(row, 0);
   }
 
   free(txt);
@@ -833,62 +6602,118 @@ void editor_jump_to_line(void)
 
 void editor_move_cursor(int key)
 {
-  struct erow *row = ed_cfg.cy >= ed_cfg.numrows ? NULL : &ed_cfg.rows[ed_cfg.cy];
-  int right_margin = row ? row->size + ed_cfg.margin_width : 0;
-  
+  struct erow *row = ed_cfg.buf->cy >= ed_cfg.buf->numrows ? NULL : &ed_cfg.buf->rows[ed_cfg.buf->cy];
+  int right_margin = row ? row->size + ed_cfg.buf->margin_width : 0;
+  int prev_rx = -1;
+  bool prev_ascii = row ? row->ascii : true;
+
+  if (row && (key == ARROW_UP || key == ARROW_DOWN))
+    prev_rx = editor_row_cx_to_rx(row, ed_cfg.buf->cx - ed_cfg.buf->margin_width);
+
   switch (key) {
     case ARROW_LEFT:
-      if (ed_cfg.cx > ed_cfg.margin_width) {
-        ed_cfg.cx--;
+      if (ed_cfg.buf->cx > ed_cfg.buf->margin_width) {
+        ed_cfg.buf->cx = editor_row_prev_cx(row, ed_cfg.buf->cx - ed_cfg.buf->margin_width) 
+          + ed_cfg.buf->margin_width;
       }
-      else if (ed_cfg.cy > 0) {
-        ed_cfg.cy--;
-        ed_cfg.cx = ed_cfg.rows[ed_cfg.cy].size + ed_cfg.margin_width;
+      else if (editor_view_prev_row(ed_cfg.buf->cy) != -1) {
+        ed_cfg.buf->cy = editor_view_prev_row(ed_cfg.buf->cy);
+        ed_cfg.buf->cx = ed_cfg.buf->rows[ed_cfg.buf->cy].size + ed_cfg.buf->margin_width;
       }
       break;
     case ARROW_RIGHT:
-      if (row && ed_cfg.cx < right_margin) {
-        ed_cfg.cx++;        
+      if (row && ed_cfg.buf->cx < right_margin) {
+        ed_cfg.buf->cx = editor_row_next_cx(row, ed_cfg.buf->cx - ed_cfg.buf->margin_width) 
+          + ed_cfg.buf->margin_width;
       }
-      else if (row && ed_cfg.cx >= right_margin && ed_cfg.cy < ed_cfg.numrows - 1) {
-        ed_cfg.cy++;
-        ed_cfg.cx = ed_cfg.margin_width;
+      else if (row && ed_cfg.buf->cx >= right_margin && 
+               editor_view_next_row(ed_cfg.buf->cy) != -1) {
+        ed_cfg.buf->cy = editor_view_next_row(ed_cfg.buf->cy);
+        ed_cfg.buf->cx = ed_cfg.buf->margin_width;
       }      
       break;
     case ARROW_DOWN:      
-      if (ed_cfg.cy < ed_cfg.numrows - 1)
-        ed_cfg.cy++;
+      if (editor_view_next_row(ed_cfg.buf->cy) != -1)
+        ed_cfg.buf->cy = editor_view_next_row(ed_cfg.buf->cy);
       break;
     case ARROW_UP:
-      if (ed_cfg.cy > 0)
-        ed_cfg.cy--;
+      if (editor_view_prev_row(ed_cfg.buf->cy) != -1)
+        ed_cfg.buf->cy = editor_view_prev_row(ed_cfg.buf->cy);
       break;
   }
   
-  row = ed_cfg.cy >= ed_cfg.numrows ? NULL : &ed_cfg.rows[ed_cfg.cy];
-  int row_len = row ? right_margin : ed_cfg.margin_width;
-  if (ed_cfg.cx > row_len) {
-    ed_cfg.cx = row_len;
+  editor_cursor_fix_column(prev_rx, prev_ascii);
+}
+
+// After moving to a different row, keep the cursor inside it and, when
+// the rows hold multi-byte text, under the same screen column as before
+void editor_cursor_fix_column(int prev_rx, bool prev_ascii)
+{
+  struct erow *row = ed_cfg.buf->cy >= ed_cfg.buf->numrows ? NULL : &ed_cfg.buf->rows[ed_cfg.buf->cy];
+  int row_len = row ? row->size + ed_cfg.buf->margin_width : ed_cfg.buf->margin_width;
+  if (ed_cfg.buf->cx > row_len) {
+    ed_cfg.buf->cx = row_len;
+  }
+  else if (row && prev_rx >= 0 && !(row->ascii && prev_ascii)) {
+    // after moving up or down, byte offsets don't line up between rows with
+    // multi-byte text, so put the cursor under the same screen column
+    ed_cfg.buf->cx = editor_row_rx_to_cx(row, prev_rx) + ed_cfg.buf->margin_width;
   }
 }
 
+// Move the cursor straight to a position in the view, for paging
+void editor_move_cursor_to_view(int v)
+{
+  struct erow *row = ed_cfg.buf->cy >= ed_cfg.buf->numrows ? NULL : &ed_cfg.buf->rows[ed_cfg.buf->cy];
+  int prev_rx = row ? editor_row_cx_to_rx(row, ed_cfg.buf->cx - ed_cfg.buf->margin_width) : -1;
+  bool prev_ascii = row ? row->ascii : true;
+
+  int view_rows = editor_view_rows();
+  if (v >= view_rows)
+    v = view_rows - 1;
+  if (v < 0)
+    v = 0;
+  ed_cfg.buf->cy = view_rows > 0 ? editor_view_to_row(v) : 0;
+
+  editor_cursor_fix_column(prev_rx, prev_ascii);
+}
+
 void editor_process_keypress(void)
 {
   static int quit_times = FEMTO_QUIT_TIMES;
   int c = editor_read_key();
 
+  editor_undo_begin(c == UTF8_KEY || (c < 256 && (c >= 128 || !iscntrl(c))) ||
+    c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY);
+
+  if (ed_cfg.buf->load && editor_key_edits(c)) {
+    editor_set_status_message("Still loading, read only until it's all in");
+    return;
+  }
+
   switch (c) {
     case '\r':
+      editor_select_clear();
       editor_insert_newline();
       break;
     case CTRL_KEY('q'):
-      if (ed_cfg.dirty && quit_times > 0) {
+      if (editor_any_dirty() && quit_times > 0) {
         editor_set_status_message("WARNING!!! File has unsaved changes. "
           "Press Ctrl-Q %d more times to quit.", quit_times);
         --quit_times;
         return;
       }
 
+      if (ed_cfg.session && !editor_session_save(ed_cfg.session, true)) {
+        char question[128];
+        snprintf(question, sizeof(question), "Session not saved (%s). Quit anyway?",
+          strerror(errno));
+        if (!editor_confirm(question))
+          return;
+      }
+      // with a session, unsaved edits keep their journal as well
+      for (struct buffer *b = ed_cfg.buffers; b; b = b->next)
+        editor_swap_close(b, !(ed_cfg.session && b->dirty));
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -899,12 +6724,27 @@ void editor_process_keypress(void)
     case CTRL_KEY('g'):
       editor_jump_to_line();
       break;
+    case CTRL_KEY('w'):
+      editor_jump_to_time();
+      break;
+    case CTRL_KEY('o'):
+      editor_buffer_open();
+      break;
+    case CTRL_KEY('n'):
+      editor_buffer_switch(1);
+      break;
+    case CTRL_KEY('p'):
+      editor_buffer_switch(-1);
+      break;
+    case CTRL_KEY('d'):
+      editor_buffer_close();
+      break;
     case HOME_KEY:
-      ed_cfg.cx = 0;
+      ed_cfg.buf->cx = ed_cfg.buf->margin_width;
       break;
     case END_KEY:
-      if (ed_cfg.cy < ed_cfg.numrows)
-        ed_cfg.cx = ed_cfg.rows[ed_cfg.cy].size;      
+      if (ed_cfg.buf->cy < ed_cfg.buf->numrows)
+        ed_cfg.buf->cx = ed_cfg.buf->rows[ed_cfg.buf->cy].size + ed_cfg.buf->margin_width;
       break;
     case CTRL_KEY('f'):
       editor_find();
@@ -912,26 +6752,18 @@ void editor_process_keypress(void)
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
+      editor_select_clear();
       if (c == DEL_KEY)
         editor_move_cursor(ARROW_RIGHT);
       editor_del_char();
       break;
     case PAGE_UP:
     case PAGE_DOWN:
-      {
-        if (c == PAGE_UP) {
-          ed_cfg.cy = ed_cfg.row_offset;          
-        }
-        else if (c == PAGE_DOWN) {
-          ed_cfg.cy = ed_cfg.row_offset + ed_cfg.screenrows - 1;
-          if (ed_cfg.cy > ed_cfg.numrows)
-            ed_cfg.cy = ed_cfg.numrows;          
-        }
-
-        int times = ed_cfg.screenrows;
-        while (times--)
-          editor_move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-      }
+      // a screenful up from the top of the screen, or down from the bottom
+      if (c == PAGE_UP)
+        editor_move_cursor_to_view(ed_cfg.buf->row_offset - ed_cfg.screenrows);
+      else
+        editor_move_cursor_to_view(ed_cfg.buf->row_offset + 2 * ed_cfg.screenrows - 1);
       break;
     case ARROW_UP:
     case ARROW_DOWN:
@@ -939,52 +6771,1129 @@ void editor_process_keypress(void)
     case ARROW_RIGHT:
       editor_move_cursor(c);
       break;
-    case CTRL_KEY('l'):
+    case CTRL_KEY('t'):
+      editor_filter();
+      break;
+    case CTRL_KEY('e'):
+      editor_filter_toggle();
+      break;
+    case CTRL_KEY('z'):
+      editor_select_clear();
+      editor_undo();
+      break;
+    case CTRL_KEY('y'):
+      editor_select_clear();
+      editor_redo();
+      break;
+    case CTRL_KEY('b'):
+      editor_select_start(false);
+      break;
+    case CTRL_KEY('k'):
+      editor_select_start(true);
+      break;
+    case CTRL_KEY('x'):
+      editor_copy(true);
+      break;
+    case CTRL_KEY('c'):
+      editor_copy(false);
+      break;
+    case CTRL_KEY('v'):
+      editor_paste();
+      break;
+    case CTRL_KEY('r'):
+      editor_sort_lines();
+      break;
     case '\x1b':
+      editor_select_clear();
+      break;
+    case CTRL_KEY('l'):
+      break;
+    case UTF8_KEY:
+      editor_select_clear();
+      editor_insert_text(ed_cfg.key_text, ed_cfg.key_len);
       break;
     default:
+      editor_select_clear();
       editor_insert_char(c);
       break;
   }
 
+  editor_undo_end();
+
   quit_times = FEMTO_QUIT_TIMES;
 }
 
+// sessions
+
+// With -s, quitting writes the state of every buffer to a session image,
+// and the next start with the same -s carries on from it: the cursor and
+// scroll positions, the filter and its index, the line index, the search
+// history, and the rows themselves, unsaved edits included. The image is
+// laid out to be mapped, not parsed. Each buffer has a row table, and each
+// row is either an offset into its file or into the image's own text. Only
+// cold rows still borrowing from a mapping of the file (with -m) can use
+// the first; every other row is copied into the image. Restoring maps both
+// files and points the rows at them, which is like loading a mapped file
+// but without looking for line ends. If the file has changed on disk
+// since, it's loaded again as usual and only the positions carry over. A
+// restored buffer with unsaved edits gets a swap file that starts from
+// what it holds. The undo journal isn't kept.
+//
+// In case we never get to quit cleanly, the event loop also writes the
+// image, at most once per FEMTO_SESSION_SAVE_MS while something has
+// changed. Those images leave out the rows (so the cost doesn't grow with
+// the files) and restoring them loads the files again, with the swap files
+// bringing back unsaved edits. Only a dirty buffer without a swap file
+// still has its rows written.
+
+#define FEMTO_SESSION_MAGIC "femtoimg"
+#define FEMTO_SESSION_VERSION 1
+
+#define SESSION_DIRTY (1 << 0)
+#define SESSION_FILTERED (1 << 1)
+#define SESSION_ROWS (1 << 2) // the row table and the indexes are there
+
+// Offsets are from the start of the image, and everything is 8 byte aligned
+struct session_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nbuffers;
+  uint32_t current;
+  uint32_t nsearches;
+  uint64_t searches; // offsets of NUL terminated strings, oldest first
+  uint64_t buffers;  // the first session_buffer
+};
+
+struct session_buffer {
+  uint64_t next;
+  uint64_t filename;
+  uint64_t file_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t dev;
+  uint64_t ino;
+  int32_t cx, cy; // cx relative to the text
+  int32_t row_offset, col_offset;
+  uint32_t format;
+  uint32_t flags;
+  uint32_t numrows;
+  uint32_t filter_count;
+  uint32_t lines_valid;
+  uint32_t reserved;
+  uint64_t filter_pattern; // 0 if there's no filter
+  uint64_t filter_rows;    // int32_t each
+  uint64_t rows;           // session_row each
+  uint64_t lines;          // int64_t each
+};
+
+struct session_row {
+  uint64_t off;
+  uint32_t size;
+  uint32_t in_image; // off is into the image, not the file
+};
+
+struct session_out {
+  FILE *fp;
+  uint64_t pos;
+  bool ok;
+};
+
+uint64_t session_align(uint64_t n)
+{
+  return (n + 7) & ~(uint64_t)7;
+}
+
+void session_put(struct session_out *out, const void *p, size_t len)
+{
+  if (out->ok && len > 0 && fwrite(p, len, 1, out->fp) != 1)
+    out->ok = false;
+  out->pos += len;
+}
+
+void session_pad(struct session_out *out)
+{
+  static const char zeros[8];
+  session_put(out, zeros, session_align(out->pos) - out->pos);
+}
+
+// The mapping of the current buffer's file as it is on disk now, if rows
+// are borrowing from one
+struct file_map *editor_session_source(const struct stat *st)
+{
+  for (struct file_map *m = ed_cfg.maps; m; m = m->next) {
+    if (m->dev == st->st_dev && m->ino == st->st_ino && m->len == (size_t)st->st_size)
+      return m;
+  }
+
+  return NULL;
+}
+
+bool editor_session_saved(struct buffer *b)
+{
+  return b->filename && b->load == NULL;
+}
+
+// Write b's part of the image, starting at out->pos, with its rows if asked
+void editor_session_put_buffer(struct session_out *out, struct buffer *b, bool last,
+  bool rows)
+{
+  struct session_buffer rec = {0};
+  struct stat st;
+  struct file_map *src = NULL;
+  if (stat(b->filename, &st) == 0) {
+    rec.file_size = st.st_size;
+    rec.mtime_sec = st.st_mtim.tv_sec;
+    rec.mtime_nsec = st.st_mtim.tv_nsec;
+    rec.dev = st.st_dev;
+    rec.ino = st.st_ino;
+    src = editor_session_source(&st);
+  }
+
+  size_t name_len = strlen(b->filename) + 1;
+  size_t pattern_len = b->filter.pattern ? strlen(b->filter.pattern) + 1 : 0;
+  rec.cx = b->cx - b->margin_width;
+  rec.cy = b->cy;
+  rec.row_offset = b->row_offset;
+  rec.col_offset = b->col_offset;
+  rec.format = b->format;
+  rec.flags = (b->dirty ? SESSION_DIRTY : 0) | (b->filter.active ? SESSION_FILTERED : 0) |
+    (rows ? SESSION_ROWS : 0);
+  rec.numrows = rows ? b->numrows : 0;
+  rec.filter_count = rows && b->filter.pattern ? b->filter.count : 0;
+  rec.lines_valid = rows ? b->lines.valid : 0;
+
+  rec.filename = out->pos + sizeof(rec);
+  uint64_t pattern = session_align(rec.filename + name_len);
+  rec.filter_pattern = pattern_len ? pattern : 0;
+  rec.rows = session_align(pattern + pattern_len);
+  rec.filter_rows = rec.rows + sizeof(struct session_row) * rec.numrows;
+  rec.lines = session_align(rec.filter_rows + sizeof(int32_t) * rec.filter_count);
+  uint64_t text = rec.lines + sizeof(int64_t) * rec.lines_valid;
+  uint64_t text_len = 0;
+  for (uint32_t j = 0; j < rec.numrows; j++) {
+    struct erow *row = &b->rows[j];
+    if (src == NULL || row->cold == NULL || row->cold->map != src)
+      text_len += row->size;
+  }
+  rec.next = last ? 0 : session_align(text + text_len);
+
+  session_put(out, &rec, sizeof(rec));
+  session_put(out, b->filename, name_len);
+  session_pad(out);
+  session_put(out, b->filter.pattern, pattern_len);
+  session_pad(out);
+
+  uint64_t at = text;
+  for (uint32_t j = 0; j < rec.numrows; j++) {
+    struct erow *row = &b->rows[j];
+    struct session_row sr = { 0, row->size, 1 };
+    if (src && row->cold && row->cold->map == src) {
+      sr.off = row->cold->data - src->base + row->cold_off;
+      sr.in_image = 0;
+    }
+    else {
+      sr.off = at;
+      at += row->size;
+    }
+    session_put(out, &sr, sizeof(sr));
+  }
+  for (uint32_t j = 0; j < rec.filter_count; j++) {
+    int32_t r = b->filter.rows[j];
+    session_put(out, &r, sizeof(r));
+  }
+  session_pad(out);
+  for (uint32_t j = 0; j < rec.lines_valid; j++) {
+    int64_t off = b->lines.offsets[j];
+    session_put(out, &off, sizeof(off));
+  }
+
+  for (uint32_t j = 0; j < rec.numrows; j++) {
+    struct erow *row = &b->rows[j];
+    if (src == NULL || row->cold == NULL || row->cold->map != src)
+      session_put(out, editor_row_text(row), row->size);
+  }
+  session_pad(out);
+}
+
+// Write the image to a temporary file next to path and rename it into
+// place: rows restored from the old image may still be reading from it.
+// Without full, only buffers that would otherwise lose edits (dirty, with
+// no swap file to replay) get their rows written. Returns false with errno
+// set if it couldn't be written.
+bool editor_session_save(const char *path, bool full)
+{
+  char *tmp = malloc(strlen(path) + 8);
+  if (tmp == NULL)
+    return false;
+  sprintf(tmp, "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  FILE *fp = fd != -1 ? fdopen(fd, "w") : NULL;
+  if (fp == NULL) {
+    int err = errno;
+    if (fd != -1) {
+      close(fd);
+      unlink(tmp);
+    }
+    free(tmp);
+    errno = err;
+    return false;
+  }
+
+  struct session_header hdr = {0};
+  memcpy(hdr.magic, FEMTO_SESSION_MAGIC, sizeof(hdr.magic));
+  hdr.version = FEMTO_SESSION_VERSION;
+  for (struct buffer *b = ed_cfg.buffers; b; b = b->next) {
+    if (b == ed_cfg.buf)
+      hdr.current = hdr.nbuffers;
+    if (editor_session_saved(b))
+      hdr.nbuffers++;
+  }
+  struct search_history *h = &ed_cfg.searches;
+  hdr.nsearches = h->count;
+  hdr.searches = sizeof(hdr);
+  uint64_t strings = hdr.searches + sizeof(uint64_t) * h->count;
+  uint64_t strings_len = 0;
+  for (int j = 0; j < h->count; j++)
+    strings_len += strlen(h->items[j]) + 1;
+  hdr.buffers = session_align(strings + strings_len);
+
+  struct session_out out = { fp, 0, true };
+  session_put(&out, &hdr, sizeof(hdr));
+  for (int j = 0; j < h->count; j++) {
+    uint64_t off = strings;
+    strings += strlen(h->items[j]) + 1;
+    session_put(&out, &off, sizeof(off));
+  }
+  for (int j = 0; j < h->count; j++)
+    session_put(&out, h->items[j], strlen(h->items[j]) + 1);
+  session_pad(&out);
+
+  uint32_t n = 0;
+  for (struct buffer *b = ed_cfg.buffers; b; b = b->next) {
+    if (!editor_session_saved(b))
+      continue;
+    editor_session_put_buffer(&out, b, ++n == hdr.nbuffers,
+      full || (b->dirty && b->swap.fd == -1));
+  }
+
+  bool ok = out.ok && fflush(fp) == 0 && fsync(fd) == 0;
+  int err = errno;
+  if (fclose(fp) != 0 && ok) {
+    err = errno;
+    ok = false;
+  }
+  if (ok && rename(tmp, path) == -1) {
+    err = errno;
+    ok = false;
+  }
+  if (!ok)
+    unlink(tmp);
+  free(tmp);
+  errno = err;
+
+  return ok;
+}
+
+// True if len bytes at off are inside the mapping
+bool session_in(struct file_map *m, uint64_t off, uint64_t len)
+{
+  return off <= m->len && len <= m->len - off;
+}
+
+const char *session_string(struct file_map *m, uint64_t off)
+{
+  if (off == 0 || off >= m->len || memchr(m->base + off, '\0', m->len - off) == NULL)
+    return NULL;
+
+  return m->base + off;
+}
+
+// Cold rows need blocks, and a block can only reach so far: one for every
+// FEMTO_MAP_BLOCK of the mapping that has rows in it
+struct cold_block *editor_session_block(struct file_map *m, struct cold_block **windows,
+  uint64_t off)
+{
+  uint64_t w = off / FEMTO_MAP_BLOCK;
+  if (windows[w] == NULL) {
+    struct cold_block *b = calloc(1, sizeof(struct cold_block));
+    if (b == NULL)
+      die("calloc");
+    uint64_t start = w * FEMTO_MAP_BLOCK;
+    b->map = m;
+    m->refs++;
+    b->data = m->base + start;
+    b->rawlen = m->len - start < UINT32_MAX ? m->len - start : UINT32_MAX;
+    editor_cold_link_block(b);
+    windows[w] = b;
+  }
+  windows[w]->live++;
+
+  return windows[w];
+}
+
+// Put the rows of rec into the (empty) current buffer. False if the image
+// doesn't hold together, or the rows in the file no longer match it.
+bool editor_session_rows(struct file_map *img, const struct session_buffer *rec,
+  bool same)
+{
+  struct buffer *buf = ed_cfg.buf;
+  if (rec->numrows > INT_MAX ||
+      !session_in(img, rec->rows, sizeof(struct session_row) * (uint64_t)rec->numrows))
+    return false;
+
+  const struct session_row *rows = (const struct session_row *)(img->base + rec->rows);
+  struct file_map *src = NULL;
+  for (uint32_t j = 0; j < rec->numrows && src == NULL; j++) {
+    if (!rows[j].in_image) {
+      if (!same)
+        return false;
+      src = editor_map_file(buf->filename);
+      if (src == NULL)
+        return false;
+      if (src->len != rec->file_size) {
+        if (src->refs == 0)
+          editor_unmap_file(src);
+        return false;
+      }
+    }
+  }
+
+  struct cold_block **img_windows = calloc(img->len / FEMTO_MAP_BLOCK + 1, 
+    sizeof(struct cold_block *));
+  struct cold_block **src_windows = src ? 
+    calloc(src->len / FEMTO_MAP_BLOCK + 1, sizeof(struct cold_block *)) : NULL;
+  buf->rows = malloc(sizeof(struct erow) * (rec->numrows ? rec->numrows : 1));
+  if (img_windows == NULL || (src && src_windows == NULL) || buf->rows == NULL)
+    die("malloc");
+  buf->rows_cap = rec->numrows ? rec->numrows : 1;
+
+  bool ok = true;
+  for (uint32_t j = 0; j < rec->numrows && ok; j++) {
+    struct file_map *m = rows[j].in_image ? img : src;
+    ok = session_in(m, rows[j].off, rows[j].size) && rows[j].size <= INT_MAX;
+    if (!ok)
+      break;
+
+    struct erow *row = &buf->rows[buf->numrows++];
+    memset(row, 0, sizeof(*row));
+    row->size = rows[j].size;
+    row->chars_cls = row->render_cls = row->hl_cls = POOL_NONE;
+    row->hl_state = HL_STATE_NORMAL;
+    row->cold = editor_session_block(m, rows[j].in_image ? img_windows : src_windows,
+      rows[j].off);
+    row->cold_off = rows[j].off % FEMTO_MAP_BLOCK;
+  }
+  free(img_windows);
+  free(src_windows);
+  if (src && src->refs == 0) {
+    editor_unmap_file(src);
+  }
+  else if (src && !ed_cfg.cold.enabled) {
+    // only -m borrows from the file, otherwise the rows are read in now
+    // (and the mapping goes with the last of them)
+    for (int j = 0; j < buf->numrows; j++) {
+      if (buf->rows[j].cold && buf->rows[j].cold->map == src)
+        editor_row_thaw(&buf->rows[j]);
+    }
+  }
+
+  return ok;
+}
+
+// The line index and filter, which the rows are all we need to check by
+void editor_session_indexes(struct file_map *img, const struct session_buffer *rec)
+{
+  struct buffer *buf = ed_cfg.buf;
+
+  if (rec->lines_valid <= (uint32_t)buf->numrows && rec->lines_valid > 0 &&
+      session_in(img, rec->lines, sizeof(int64_t) * (uint64_t)rec->lines_valid)) {
+    buf->lines.offsets = malloc(sizeof(long long) * rec->lines_valid);
+    if (buf->lines.offsets == NULL)
+      die("malloc");
+    memcpy(buf->lines.offsets, img->base + rec->lines, sizeof(int64_t) * rec->lines_valid);
+    buf->lines.valid = buf->lines.cap = rec->lines_valid;
+  }
+
+  const char *pattern = session_string(img, rec->filter_pattern);
+  if (pattern == NULL || rec->filter_count > (uint32_t)buf->numrows ||
+      !session_in(img, rec->filter_rows, sizeof(int32_t) * (uint64_t)rec->filter_count))
+    return;
+
+  struct line_filter *f = &buf->filter;
+  const int32_t *rows = (const int32_t *)(img->base + rec->filter_rows);
+  for (uint32_t j = 0; j < rec->filter_count; j++) {
+    // the index has to be sorted and in range, or the view falls apart
+    if (rows[j] < 0 || rows[j] >= buf->numrows || (j > 0 && rows[j] <= rows[j - 1]))
+      return;
+  }
+  f->rows = malloc(sizeof(int) * (rec->filter_count ? rec->filter_count : 1));
+  if (f->rows == NULL)
+    die("malloc");
+  memcpy(f->rows, rows, sizeof(int32_t) * rec->filter_count);
+  f->count = f->cap = rec->filter_count;
+  f->pattern = strdup(pattern);
+  f->active = rec->flags & SESSION_FILTERED;
+}
+
+// Bring back one buffer into the (empty) current buffer. False if even
+// its file can't be loaded.
+bool editor_session_buffer(struct file_map *img, const struct session_buffer *rec,
+  const char *filename)
+{
+  struct buffer *buf = ed_cfg.buf;
+  struct stat st;
+  bool dirty = rec->flags & SESSION_DIRTY;
+  bool same = stat(filename, &st) == 0 && (uint64_t)st.st_size == rec->file_size &&
+    st.st_mtim.tv_sec == rec->mtime_sec && st.st_mtim.tv_nsec == rec->mtime_nsec &&
+    (uint64_t)st.st_dev == rec->dev && (uint64_t)st.st_ino == rec->ino;
+
+  buf->filename = strdup(filename);
+  editor_select_syntax_highlight();
+  buf->format = rec->format <= FORMAT_ZSTD ? rec->format : FORMAT_PLAIN;
+  bool rows = rec->flags & SESSION_ROWS;
+  bool restored = rows && (same || dirty) && editor_session_rows(img, rec, same);
+  if (!restored) {
+    // start over from the file, keeping only the positions
+    editor_free_rows(buf);
+    if (!editor_open((char *)filename))
+      return false;
+    const char *pattern = session_string(img, rec->filter_pattern);
+    if (pattern && buf->load == NULL) {
+      editor_filter_build(pattern);
+      buf->filter.active = rec->flags & SESSION_FILTERED;
+    }
+    // without rows, the swap file has any unsaved edits
+    if (rows && (same || dirty))
+      editor_set_status_message("Session for %s is damaged, loaded the file", filename);
+    else if (!same)
+      editor_set_status_message("%s changed since the session, loaded it again", filename);
+  }
+  else {
+    editor_session_indexes(img, rec);
+    buf->dirty = dirty;
+    if (!same)
+      editor_set_status_message("%s changed since the session, unsaved changes kept", 
+        filename);
+    // the journal replays over the file, which a dirty buffer isn't, so
+    // its journal starts over from what it is now
+    if (dirty)
+      editor_swap_seed(buf);
+    else
+      editor_swap_open(buf, true);
+  }
+
+  editor_set_margin_width();
+  buf->cy = rec->cy >= 0 && rec->cy <= buf->numrows ? rec->cy : 0;
+  int size = buf->cy < buf->numrows ? buf->rows[buf->cy].size : 0;
+  buf->cx = (rec->cx >= 0 && rec->cx <= size ? rec->cx : 0) + buf->margin_width;
+  buf->row_offset = rec->row_offset >= 0 ? rec->row_offset : 0;
+  buf->col_offset = rec->col_offset >= 0 ? rec->col_offset : 0;
+
+  return true;
+}
+
+// Restore the session in path into buffers, the first of them the
+// current (empty) one. Returns the buffer that was on screen, or NULL if
+// there's no session to restore.
+struct buffer *editor_session_restore(const char *path)
+{
+  struct file_map *img = editor_map_file(path);
+  if (img == NULL)
+    return NULL;
+  // hold on to it while we're reading it
+  img->refs++;
+
+  const struct session_header *hdr = (const struct session_header *)img->base;
+  struct buffer *current = NULL;
+  if (!session_in(img, 0, sizeof(*hdr)) || 
+      memcmp(hdr->magic, FEMTO_SESSION_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != FEMTO_SESSION_VERSION) {
+    editor_unmap_file(img);
+    return NULL;
+  }
+
+  if (session_in(img, hdr->searches, sizeof(uint64_t) * (uint64_t)hdr->nsearches)) {
+    const uint64_t *offs = (const uint64_t *)(img->base + hdr->searches);
+    for (uint32_t j = 0; j < hdr->nsearches; j++) {
+      const char *query = session_string(img, offs[j]);
+      if (query)
+        editor_search_history_add(query);
+    }
+  }
+
+  uint64_t off = hdr->buffers;
+  int n = 0;
+  for (uint32_t j = 0; j < hdr->nbuffers && session_in(img, off, 
+      sizeof(struct session_buffer)); j++) {
+    const struct session_buffer *rec = (const struct session_buffer *)(img->base + off);
+    const char *filename = session_string(img, rec->filename);
+    off = rec->next;
+    if (filename == NULL)
+      break;
+
+    if (n > 0)
+      editor_buffer_new();
+    if (!editor_session_buffer(img, rec, filename)) {
+      editor_set_status_message("Can't open %s: %s", filename, strerror(errno));
+      editor_buffer_free(ed_cfg.buf);
+      continue;
+    }
+    n++;
+    if (j == hdr->current || current == NULL)
+      current = ed_cfg.buf;
+    if (off == 0)
+      break;
+  }
+  editor_unmap_file(img);
+
+  return current;
+}
+
+// server
+
+// femto -S keeps files loaded in a background process that listens on a
+// Unix socket. femto -c hands its terminal to that process (the tty fds go
+// over the socket) and waits. The server forks a child for each client, so
+// the child starts with the rows, mappings and indexes already built and
+// only has to set up the screen. The server loads the files it was started
+// with; a file it doesn't hold, or that changed on disk since, is loaded by
+// the child, so the server goes on accepting meanwhile (and the next client
+// for that file loads it again). The child's edits are its
+// own, so two terminals on the same file each get a private copy; the swap
+// file lock still stops the second from journaling over the first. Without
+// a server, -c just runs femto as usual.
+
+#define FEMTO_SERVER_MAX_REQUEST (1024 * 1024)
+
+// What the server knows about a file it holds
+struct server_file {
+  struct buffer *buf;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+};
+
+struct server_state {
+  struct server_file *files;
+  int nfiles;
+  int listen_fd;
+  bool swap_enabled; // for the children: the server itself never journals
+};
+
+struct server_state server;
+
+// $XDG_RUNTIME_DIR/femto.sock, or one per user in /tmp
+bool editor_server_path(struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  int len = dir && *dir ? 
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/femto.sock", dir) :
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/femto-%d.sock", (int)getuid());
+
+  return len > 0 && (size_t)len < sizeof(addr->sun_path);
+}
+
+// name relative to cwd, without resolving symlinks, so it reads the same
+char *editor_absolute_path(const char *cwd, const char *name)
+{
+  char *path = malloc(strlen(cwd) + strlen(name) + 2);
+  if (path == NULL)
+    die("malloc");
+  if (name[0] == '/')
+    strcpy(path, name);
+  else
+    sprintf(path, "%s/%s", cwd, name);
+
+  return path;
+}
+
+// The server's buffer for path, loaded now if it isn't, or if the file has
+// changed since it was
+struct server_file *editor_server_load(const char *path)
+{
+  struct stat st;
+  if (stat(path, &st) == -1)
+    return NULL;
+
+  for (int j = 0; j < server.nfiles; j++) {
+    struct server_file *f = &server.files[j];
+    if (f->dev != st.st_dev || f->ino != st.st_ino)
+      continue;
+    if (f->size == st.st_size && f->mtime.tv_sec == st.st_mtim.tv_sec &&
+        f->mtime.tv_nsec == st.st_mtim.tv_nsec)
+      return f;
+
+    editor_buffer_free(f->buf);
+    server.files[j] = server.files[--server.nfiles];
+    break;
+  }
+
+  // the new buffer goes at the end, and stays current
+  while (ed_cfg.buf->next)
+    ed_cfg.buf = ed_cfg.buf->next;
+  struct buffer *b = editor_buffer_new();
+  if (!editor_open((char *)path)) {
+    editor_buffer_free(b);
+    return NULL;
+  }
+  // a child can't take over a loading thread, so finish here
+  while (b->load) {
+    if (!editor_stream_poll(b))
+      usleep(1000);
+  }
+  if (b->filename == NULL) {
+    editor_buffer_free(b);
+    return NULL;
+  }
+
+  struct server_file *files = realloc(server.files, 
+    sizeof(struct server_file) * (server.nfiles + 1));
+  if (files == NULL)
+    die("realloc");
+  server.files = files;
+  struct server_file *f = &server.files[server.nfiles++];
+  f->buf = ed_cfg.buf;
+  f->dev = st.st_dev;
+  f->ino = st.st_ino;
+  f->size = st.st_size;
+  f->mtime = st.st_mtim;
+
+  return f;
+}
+
+// The main loop, once the buffers are in place. Opening them may have
+// left something to say; otherwise start with the help.
+void editor_run(void)
+{
+  if (ed_cfg.status_msg[0] == '\0')
+    editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find"
+      " | Ctrl-W = goto time | Ctrl-T = filter | Ctrl-Z/Y = undo/redo"
+      " | Ctrl-O = open | Ctrl-N/P = next/prev buffer | Ctrl-D = close"
+      " | Ctrl-B/K = select text/lines | Ctrl-X/C/V = cut/copy/paste"
+      " | Ctrl-R = sort/uniq/reverse");
+
+  while (1) {
+    // a swap file waiting for its buffer to come on screen
+    if (ed_cfg.buf->swap.recover)
+      editor_swap_open(ed_cfg.buf, true);
+    editor_refresh_screen();
+    editor_process_keypress();
+  }
+}
+
+// In the child forked for a client: take over its terminal and edit the
+// files it asked for, out of the buffers we inherited or loaded here.
+// files is the client's working directory followed by the paths. A file
+// that can't be loaded fails the client the way a failed fork does.
+void editor_server_child(int conn, int *fds, char **files, int nfiles)
+{
+  close(server.listen_fd);
+  signal(SIGCHLD, SIG_DFL);
+  for (int j = 0; j < 3; j++) {
+    dup2(fds[j], j);
+    close(fds[j]);
+  }
+  if (chdir(files[0]) == -1)
+    die("chdir");
+
+  // the buffers nobody asked for stay behind, untouched
+  struct buffer **chosen = calloc(nfiles, sizeof(struct buffer *));
+  if (chosen == NULL)
+    die("calloc");
+  int n = 0;
+  for (int j = 1; j < nfiles; j++) {
+    struct server_file *f = editor_server_load(files[j]);
+    if (f == NULL) {
+      char msg[256];
+      int len = snprintf(msg, sizeof(msg), "femto: can't open %s: %s\n", files[j],
+        strerror(errno));
+      write_all(STDERR_FILENO, msg, len < (int)sizeof(msg) ? len : (int)sizeof(msg) - 1);
+      write_all(conn, "!", 1);
+      exit(1);
+    }
+    bool dup = false;
+    for (int k = 0; k < n; k++)
+      dup = dup || chosen[k] == f->buf;
+    if (!dup)
+      chosen[n++] = f->buf;
+  }
+
+  enable_rawmode();
+  editor_init_screen();
+  ed_cfg.swap_enabled = server.swap_enabled;
+  ed_cfg.buffers = ed_cfg.buf = NULL;
+  ed_cfg.nbuffers = 0;
+  for (int j = 0; j < n; j++) {
+    struct buffer *b = chosen[j];
+    b->prev = j > 0 ? chosen[j - 1] : NULL;
+    b->next = j + 1 < n ? chosen[j + 1] : NULL;
+    ed_cfg.nbuffers++;
+  }
+  ed_cfg.buffers = n > 0 ? chosen[0] : NULL;
+  free(chosen);
+  if (ed_cfg.buffers == NULL)
+    editor_buffer_new();
+
+  ed_cfg.buf = ed_cfg.buffers;
+  for (struct buffer *b = ed_cfg.buffers; b; b = b->next)
+    editor_swap_open(b, true);
+
+  editor_run();
+}
+
+// Read a client's request: its tty fds, and its working directory and
+// files as NUL terminated strings
+char *editor_server_receive(int conn, int *fds, uint32_t *len)
+{
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec iov = { len, sizeof(*len) };
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != sizeof(*len))
+    return NULL;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+    return NULL;
+  memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+  char *req = NULL;
+  if (*len == 0 || *len > FEMTO_SERVER_MAX_REQUEST || (req = malloc(*len)) == NULL) {
+    for (int j = 0; j < 3; j++)
+      close(fds[j]);
+    return NULL;
+  }
+  size_t got = 0;
+  while (got < *len) {
+    ssize_t n = read(conn, req + got, *len - got);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    got += n;
+  }
+  if (got < *len || req[*len - 1] != '\0') {
+    for (int j = 0; j < 3; j++)
+      close(fds[j]);
+    free(req);
+    return NULL;
+  }
+
+  return req;
+}
+
+void editor_server_accept(void)
+{
+  int conn = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (conn == -1)
+    return;
+
+  // the child runs as us, so only we get to ask for one
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 ||
+      cred.uid != getuid()) {
+    close(conn);
+    return;
+  }
+  struct timeval timeout = { 5, 0 };
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  int fds[3];
+  uint32_t len;
+  char *req = editor_server_receive(conn, fds, &len);
+  if (req == NULL) {
+    close(conn);
+    return;
+  }
+
+  int nfiles = 0;
+  char **files = malloc(sizeof(char *) * len);
+  if (files == NULL)
+    die("malloc");
+  for (uint32_t off = 0; off < len; off += strlen(req + off) + 1)
+    files[nfiles++] = req + off;
+
+  // the child keeps conn open until it exits, which is what the client
+  // waits for
+  pid_t pid = fork();
+  if (pid == 0)
+    editor_server_child(conn, fds, files, nfiles);
+  if (pid == -1) {
+    // the client is waiting on conn: a byte there means it failed
+    char msg[128];
+    int n = snprintf(msg, sizeof(msg), "femto: server can't start an editor: %s\n",
+      strerror(errno));
+    write_all(fds[2], msg, n);
+    write_all(conn, "!", 1);
+  }
+
+  for (int j = 0; j < 3; j++)
+    close(fds[j]);
+  close(conn);
+  free(files);
+  free(req);
+}
+
+// femto -S: load the files, then go into the background and serve
+void editor_server(int nfiles, char **files)
+{
+  struct sockaddr_un addr;
+  if (!editor_server_path(&addr)) {
+    fprintf(stderr, "femto: socket path too long\n");
+    exit(1);
+  }
+
+  // a socket nobody answers on is left over from a server that died
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "femto: a server is already running on %s\n", addr.sun_path);
+    exit(1);
+  }
+  close(probe);
+  unlink(addr.sun_path);
+
+  server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  mode_t mask = umask(0077);
+  if (server.listen_fd == -1 || 
+      bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(server.listen_fd, 16) == -1) {
+    perror("femto: server socket");
+    exit(1);
+  }
+  umask(mask);
+
+  server.swap_enabled = ed_cfg.swap_enabled;
+  ed_cfg.swap_enabled = false;
+  editor_buffer_new();
+  char *cwd = getcwd(NULL, 0);
+  if (cwd == NULL)
+    die("getcwd");
+  for (int j = 0; j < nfiles; j++) {
+    char *path = editor_absolute_path(cwd, files[j]);
+    if (editor_server_load(path) == NULL)
+      fprintf(stderr, "femto: can't load %s\n", files[j]);
+    free(path);
+  }
+  free(cwd);
+
+  pid_t pid = fork();
+  if (pid == -1)
+    die("fork");
+  if (pid > 0) {
+    printf("femto server on %s\n", addr.sun_path);
+    exit(0);
+  }
+
+  setsid();
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGHUP, SIG_IGN);
+  int null = open("/dev/null", O_RDWR);
+  for (int j = 0; j < 3 && null != -1; j++)
+    dup2(null, j);
+  if (null > 2)
+    close(null);
+  if (chdir("/") == -1)
+    exit(1);
+
+  while (1)
+    editor_server_accept();
+}
+
+// femto -c: hand our terminal to the server and wait for it to be done
+// with it. Only returns if there's no server to hand it to.
+void editor_client(int nfiles, char **files)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  if (!editor_server_path(&addr) || lstat(addr.sun_path, &st) == -1 ||
+      st.st_uid != getuid() || !S_ISSOCK(st.st_mode))
+    return;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    if (fd != -1)
+      close(fd);
+    return;
+  }
+
+  char *cwd = getcwd(NULL, 0);
+  if (cwd == NULL)
+    die("getcwd");
+  struct abuf req = { NULL, 0 };
+  abuf_append(&req, cwd, strlen(cwd) + 1);
+  for (int j = 0; j < nfiles; j++) {
+    char *path = editor_absolute_path(cwd, files[j]);
+    abuf_append(&req, path, strlen(path) + 1);
+    free(path);
+  }
+  free(cwd);
+
+  uint32_t len = req.len;
+  int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = { &len, sizeof(len) };
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(fd, &msg, 0) != sizeof(len) || !write_all(fd, req.b, req.len)) {
+    perror("femto: server");
+    exit(1);
+  }
+  abuf_free(&req);
+
+  // EOF once the editor exits, or a byte if the server couldn't start one
+  char c;
+  ssize_t n;
+  while ((n = read(fd, &c, 1)) == -1 && errno == EINTR)
+    ;
+  exit(n == 1 ? 1 : 0);
+}
+
 // Init
 void editor_init(void)
 {
-  ed_cfg.cx = 0;
-  ed_cfg.cy = 0;
-  ed_cfg.rx = 0;
-  ed_cfg.row_offset = 0;
-  ed_cfg.col_offset = 0;
-  ed_cfg.numrows = 0;
-  ed_cfg.margin_width = 0;  
-  ed_cfg.rows = NULL;
-  ed_cfg.dirty = false;
-  ed_cfg.filename = NULL;
+  ed_cfg.buf = NULL;
+  ed_cfg.buffers = NULL;
+  ed_cfg.nbuffers = 0;
+  ed_cfg.row_bytes = 0;
+  memset(&ed_cfg.cold, 0, sizeof(ed_cfg.cold));
+  // clips and undo can make rows cold even without -m
+  ed_cfg.cold.cache_cap = 4 * FEMTO_COLD_BLOCK;
+  ed_cfg.maps = NULL;
+  memset(&ed_cfg.yank, 0, sizeof(ed_cfg.yank));
+  ed_cfg.clip_ids = 0;
+  memset(&ed_cfg.searches, 0, sizeof(ed_cfg.searches));
+  ed_cfg.session = NULL;
+  ed_cfg.session_behind = false;
+  ed_cfg.session_written = 0;
+  ed_cfg.undo_budget = FEMTO_UNDO_BUDGET;
+  ed_cfg.swap_enabled = true;
   ed_cfg.status_msg[0] = '\0';
   ed_cfg.status_msg_time = 0;
+  ed_cfg.key_len = 0;
+}
 
+void editor_init_screen(void)
+{
   if (get_window_size(&ed_cfg.screenrows, &ed_cfg.screencols) == -1)
     die("get_window_size");
   ed_cfg.screenrows -= 2;
-  ed_cfg.display_cols = ed_cfg.screencols;
+}
+
+// Parse a byte count with an optional k, m or g suffix
+long long parse_size(const char *s)
+{
+  char *end;
+  long long n = strtoll(s, &end, 10);
+  if (end == s || n < 0)
+    return -1;
+
+  switch (tolower((unsigned char)*end)) {
+    case 'g': n *= 1024;
+    // fall through
+    case 'm': n *= 1024;
+    // fall through
+    case 'k': n *= 1024;
+      ++end;
+      break;
+  }
+
+  return *end == '\0' ? n : -1;
+}
+
+void usage(void)
+{
+  fprintf(stderr, "usage: femto [-cnS] [-m resident-bytes] [-s session] [-u undo-bytes] "
+    "[file...]\n"
+    "  -c  open the files in the running server, if there is one\n"
+    "  -m  map files in place, and compress lines away from the screen to stay\n"
+    "      around this size\n"
+    "  -n  don't keep a swap file for crash recovery\n"
+    "  -s  carry on from this session image, and save it on quitting\n"
+    "  -S  keep the files loaded in a server, for femto -c\n");
+  exit(1);
 }
 
 int main(int argc, char **argv)
 {
-  enable_rawmode();
+  size_t undo_budget = FEMTO_UNDO_BUDGET;
+  bool swap_enabled = true;
+  long long resident = 0;
+  bool client = false;
+  bool serve = false;
+  char *session = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "cm:ns:Su:")) != -1) {
+    switch (opt) {
+      case 's':
+        session = optarg;
+        break;
+      case 'c':
+        client = true;
+        break;
+      case 'S':
+        serve = true;
+        break;
+      case 'm':
+        resident = parse_size(optarg);
+        if (resident <= 0)
+          usage();
+        break;
+      case 'n':
+        swap_enabled = false;
+        break;
+      case 'u': {
+        long long n = parse_size(optarg);
+        if (n < 0)
+          usage();
+        undo_budget = n;
+        break;
+      }
+      default:
+        usage();
+    }
+  }
+
+  if (client && !serve)
+    editor_client(argc - optind, &argv[optind]);
+
   editor_init();
+  ed_cfg.undo_budget = undo_budget;
+  ed_cfg.swap_enabled = swap_enabled;
+  if (resident > 0)
+    editor_cold_configure(resident);
+  if (serve)
+    editor_server(argc - optind, &argv[optind]);
 
-  if (argc >= 2) {
-    editor_open(argv[1]);
+  enable_rawmode();
+  editor_init_screen();
+  editor_buffer_new();
+  struct buffer *current = session ? editor_session_restore(session) : NULL;
+  ed_cfg.session = session;
+  for (int j = optind; j < argc; j++) {
+    if (j > optind || current)
+      editor_buffer_new();
+    if (!editor_open(argv[j]))
+      die("fopen");
   }
-  
-  editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  ed_cfg.buf = current ? current : ed_cfg.buffers;
 
-  while (1) {
-    editor_refresh_screen();
-    editor_process_keypress();
-  }
+  editor_run();
 }